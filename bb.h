@@ -13,6 +13,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 
 #if defined(BB_PLATFORM_WINDOWS)
@@ -52,7 +53,7 @@
 # define BB_CRIT
 # define BB_BOLD
 # undef BB_DISABLE_COLORS
-# define BB_DISABLE_COLORS "-DBB_DISABLE_COLORS"
+# define BB_DISABLE_COLORS "-DBB_DISABLE_COLORS",
 #endif
 
 #define bb_info(msg, ...) \
@@ -75,27 +76,67 @@
 #define BB_UNUSED(x) ((void)(x))
 
 #ifndef BB_STRING_MIN_CAPACITY
-# define BB_STRING_MIN_CAPACITY 64
+# define BB_STRING_MIN_CAPACITY 32
 #endif
 
 #ifndef BB_VECTOR_MIN_CAPACITY
 # define BB_VECTOR_MIN_CAPACITY 16
 #endif
 
+// The allocator can be replaced by defining all of BB_MALLOC, BB_REALLOC
+// and BB_FREE, which behave like their libc counterparts.
+#if !defined(BB_MALLOC) && !defined(BB_REALLOC) && !defined(BB_FREE)
+# define BB_MALLOC(size) malloc(size)
+# define BB_REALLOC(buffer, size) realloc(buffer, size)
+# define BB_FREE(buffer) free(buffer)
+#elif !defined(BB_MALLOC) || !defined(BB_REALLOC) || !defined(BB_FREE)
+# error "BB_MALLOC, BB_REALLOC and BB_FREE must be defined together"
+#endif
+
 #define BB_TRUE  1
 #define BB_FALSE 0
 
+typedef struct _bb_arena_block_s {
+  struct _bb_arena_block_s* prev;
+  size_t size;
+  size_t used;
+  char data[];
+} _bb_arena_block_t;
+
+// A bump allocator: allocations are carved out of big blocks and are never
+// freed one by one, but all together, with bb_arena_reset(..) or
+// bb_arena_destroy(..).
+typedef struct {
+  _bb_arena_block_t* block; // Most recent block, NULL if none.
+  size_t block_size;
+} *bb_arena_t;
+
+typedef struct {
+  _bb_arena_block_t* block;
+  size_t used;
+} bb_arena_mark_t;
+
+// A string is allocated together with its initial buffer, so short strings
+// take a single allocation. Only when it outgrows that buffer, cstr is moved
+// to a separate allocation.
 typedef struct {
   size_t capacity;
   size_t length;
   char* cstr;
+  bb_arena_t arena; // Where the string is allocated, NULL for the heap.
+  char inline_cstr[];
 } *bb_string_t;
 
 typedef struct {
   int argc;
   int envc;
-  bb_string_t argv;
-  bb_string_t envp;
+  char** argv; // NULL-terminated.
+  char** envp; // NULL-terminated, entries are in the form NAME=VALUE.
+  int capture;
+  uint64_t memory; // Expected peak memory use in bytes, 0 if unknown.
+  bb_string_t out; // Captured standard output, if capture is set.
+  bb_string_t err; // Captured standard error, if capture is set.
+  bb_arena_t arena; // Where argv and envp are allocated, NULL for the heap.
 } *bb_cmd_t;
 
 #if defined(BB_PLATFORM_LINUX) || defined(BB_PLATFORM_APPLE)
@@ -106,21 +147,162 @@ typedef struct {
 # error "Unsupported platform"
 #endif
 
+// Resources used by a child process.
+typedef struct {
+  uint64_t wall_ns;
+  uint64_t user_ns;
+  uint64_t sys_ns;
+  uint64_t max_rss; // Peak resident set size, in bytes.
+} bb_usage_t;
+
+typedef enum {
+  BB_JOB_PENDING,
+  BB_JOB_RUNNING,
+  BB_JOB_DONE
+} bb_job_state_t;
+
+typedef struct {
+  size_t id;
+  bb_job_state_t state;
+  int exit_status;
+  bb_cmd_t cmd;
+  bb_proc_t proc;
+  int out_fd;
+  int err_fd;
+  int pid_fd;          // Readable once it exits, if supported, or -1.
+  uint64_t start_time; // Monotonic time it was started at, in nanoseconds.
+  bb_usage_t usage;    // Filled in once it's done.
+  int keep_stat_cache; // Set if the submitter invalidates what it wrote.
+  void* data;
+} *bb_job_t;
+
+typedef struct {
+  size_t max_jobs;
+  size_t running;
+  size_t next_pending;
+  size_t next_done;
+  bb_job_t* jobs;
+  bb_job_t* done;
+  bb_job_t* slots;
+  uint64_t memory_budget; // Limit on the expected memory of running jobs.
+  uint64_t memory_used;   // Expected memory of the running jobs.
+  int watch_pressure;     // Hold jobs back while memory is short.
+  int throttled;          // Jobs are held back by memory pressure, or
+                          // waiting for a jobserver token.
+} *bb_jobs_t;
+
+// A hash map from byte strings to values of value_size bytes. The keys
+// are copied into the map.
+typedef struct {
+  size_t capacity;   // Number of slots, a power of 2.
+  size_t length;
+  size_t value_size;
+  size_t stride;     // Size of a slot, followed by its value.
+  char* slots;
+  char* scratch;     // Room for two slots, used while moving them around.
+  bb_arena_t keys;
+} *bb_map_t;
+
+typedef enum {
+  BB_FILE_WRITE_SYNC = 1 << 0,       // Flush the data to disk before renaming.
+  BB_FILE_WRITE_IF_CHANGED = 1 << 1  // Keep the file if it has the same data.
+} bb_file_write_flags_t;
+
+typedef struct {
+  const void* data; // Not NUL-terminated.
+  size_t size;
+  int mapped;
+} *bb_file_view_t;
+
+// Called for every entry found by bb_file_walk(..). For directories, the
+// return value tells whether to walk them too.
+typedef int (*bb_file_walk_fn_t)(const char* path, int is_dir, void* data);
+
+typedef struct {
+  size_t count;
+  char** paths; // Vector of count paths, sorted, pointing into data.
+  char* data;
+} *bb_file_list_t;
+
+typedef struct {
+  char* path;
+  size_t producer; // Id of the rule producing this file plus 1, 0 if none.
+  int stated;
+  int hashed;
+  time_t mtime;    // 0 if the file does not exist.
+  uint64_t size;
+  uint64_t hash;   // Hash of the contents, valid if hashed is set.
+} *bb_graph_node_t;
+
+typedef enum {
+  BB_RULE_WAITING,
+  BB_RULE_CACHING,    // Its input is being preprocessed, to look it up.
+  BB_RULE_RUNNING,
+  BB_RULE_DONE,
+  BB_RULE_FAILED
+} bb_rule_state_t;
+
+typedef struct {
+  size_t id;
+  bb_rule_state_t state;
+  int blocked;
+  size_t pending;
+  size_t depfile;     // Id of the depfile node plus 1, 0 if none.
+  bb_cmd_t recipe;
+  size_t* inputs;
+  size_t* outputs;
+  size_t* discovered; // Inputs found in the depfile.
+  size_t* dependents;
+  uint64_t cache_key[2]; // Key in the compilation cache, 0 if none.
+} *bb_rule_t;
+
+typedef struct {
+  bb_graph_node_t* nodes;
+  bb_rule_t* rules;
+  bb_map_t index;   // Node paths to their id.
+  bb_arena_t arena; // Holds the nodes and their paths.
+} *bb_graph_t;
+
+bb_arena_t bb_arena_new(size_t block_size);
+void* bb_arena_alloc(bb_arena_t arena, size_t size);
+char* bb_arena_strdup(bb_arena_t arena, const char* s);
+bb_arena_mark_t bb_arena_mark(bb_arena_t arena);
+void bb_arena_reset(bb_arena_t arena, bb_arena_mark_t mark);
+void bb_arena_destroy(bb_arena_t* arena);
+
 bb_string_t bb_string_new(size_t initial_capacity);
 #define bb_string_default() bb_string_new(0)
+bb_string_t bb_string_new_in(bb_arena_t arena, size_t initial_capacity);
 bb_string_t bb_string_from_cstr(const char* cstr);
+bb_string_t bb_string_from_cstr_in(bb_arena_t arena, const char* cstr);
 void bb_string_concat(bb_string_t dst, const char* src);
+void bb_string_concat_n(bb_string_t dst, const char* src, size_t n);
 void bb_string_append(bb_string_t dst, char c);
+void bb_string_appendf(bb_string_t dst, const char* fmt, ...);
+void bb_string_reserve(bb_string_t str, size_t capacity);
+void bb_string_shrink_to_fit(bb_string_t str);
 void bb_string_destroy(bb_string_t* str);
 
 void bb_file_copy(const char* src_path, const char* dst_path);
 void bb_file_write(const char* path, const void* buffer, size_t size);
+int bb_file_write_atomic(const char* path, const void* buffer, size_t size,
+                         int flags);
 void* bb_file_read(const char* path);
+void* bb_file_read_sized(const char* path, size_t* size);
 void bb_file_free(void** buffer);
-void bb_file_delete(const char* path);
+bb_file_view_t bb_file_view_open(const char* path);
+void bb_file_view_close(bb_file_view_t* view);
+size_t bb_file_delete(const char* path);
+size_t bb_file_delete_parallel(const char* path, size_t n_threads);
 void bb_file_makedirs_from(const char* base, const char* path, int exist_ok);
 void bb_file_makedirs(const char* dir_path, int exist_ok);
 int bb_file_cmpmodtime(const char* a_path, const char* b_path);
+void bb_file_invalidate(const char* path);
+void bb_file_cache_stats(size_t* hits, size_t* misses);
+void bb_file_walk(const char* dir_path, bb_file_walk_fn_t fn, void* data);
+int bb_glob_match(const char* pattern, const char* path);
+bb_file_list_t bb_file_glob(const char* pattern);
+void bb_file_list_destroy(bb_file_list_t* list);
 
 const char* bb_params_get_string(const char* long_name, char short_name,
                                  const char* help, const char* default_value);
@@ -132,49 +314,142 @@ int bb_params_get_switch(const char* long_name, char short_name,
                          const char* help, int default_value);
 
 bb_cmd_t bb_cmd_new(void);
+bb_cmd_t bb_cmd_new_in(bb_arena_t arena);
 void _bb_cmd_append_args(bb_cmd_t cmd, ...);
 #define bb_cmd_append_args(cmd, ...) \
   _bb_cmd_append_args(cmd, ##__VA_ARGS__, NULL)
 void _bb_cmd_append_envs(bb_cmd_t cmd, ...);
 #define bb_cmd_append_envs(cmd, ...) \
   _bb_cmd_append_envs(cmd, ##__VA_ARGS__, NULL)
-int _bb_cmd_run(bb_cmd_t cmd, ...);
-#define bb_cmd_run(cmd, ...) \
-  _bb_cmd_run(cmd, ##__VA_ARGS__, NULL)
-bb_proc_t _bb_cmd_run_async(bb_cmd_t cmd, ...);
-#define bb_cmd_run_async(cmd, ...) \
-  _bb_cmd_run_async(cmd, ##__VA_ARGS__, NULL)
+void bb_cmd_append_argf(bb_cmd_t cmd, const char* fmt, ...);
+void bb_cmd_append_envf(bb_cmd_t cmd, const char* fmt, ...);
+void bb_cmd_set_capture(bb_cmd_t cmd, int capture);
+void bb_cmd_set_memory(bb_cmd_t cmd, uint64_t bytes);
+int bb_cmd_run(bb_cmd_t cmd);
+bb_proc_t bb_cmd_run_async(bb_cmd_t cmd);
 int bb_cmd_wait(bb_proc_t proc);
+int bb_cmd_wait_usage(bb_proc_t proc, bb_usage_t* usage);
 void bb_cmd_destroy(bb_cmd_t* cmd);
+bb_cmd_t bb_cmd_clone(bb_cmd_t cmd);
 bb_string_t bb_cmd_to_string(bb_cmd_t cmd);
 
+void bb_usage_summary_print(size_t top);
+void bb_usage_summary_reset(void);
+
+size_t bb_cpu_count(void);
+bb_jobs_t bb_jobs_new(size_t max_jobs);
+void bb_jobs_set_memory_limit(bb_jobs_t jobs, uint64_t budget,
+                              int watch_pressure);
+bb_job_t bb_jobs_submit(bb_jobs_t jobs, bb_cmd_t* cmd);
+bb_job_t bb_jobs_wait_any(bb_jobs_t jobs);
+size_t bb_jobs_wait_all(bb_jobs_t jobs);
+void bb_jobs_destroy(bb_jobs_t* jobs);
+
+bb_graph_t bb_graph_new(void);
+bb_rule_t bb_graph_add_rule(bb_graph_t graph, bb_cmd_t* recipe);
+void _bb_graph_add_inputs(bb_graph_t graph, bb_rule_t rule, ...);
+#define bb_graph_add_inputs(graph, rule, ...) \
+  _bb_graph_add_inputs(graph, rule, ##__VA_ARGS__, NULL)
+void _bb_graph_add_outputs(bb_graph_t graph, bb_rule_t rule, ...);
+#define bb_graph_add_outputs(graph, rule, ...) \
+  _bb_graph_add_outputs(graph, rule, ##__VA_ARGS__, NULL)
+void bb_graph_set_depfile(bb_graph_t graph, bb_rule_t rule, const char* path);
+size_t bb_graph_build(bb_graph_t graph, bb_jobs_t jobs);
+void bb_graph_destroy(bb_graph_t* graph);
+
+void bb_cache_enable(const char* dir, uint64_t max_size, int hardlink);
+void bb_cache_stats(size_t* hits, size_t* misses);
+
+void bb_trace_enable(const char* path);
+void bb_trace_write(void);
+uint64_t bb_trace_begin(void);
+void bb_trace_end(const char* name, uint64_t start);
+
 void* _bb_vector_new(size_t item_size, size_t length);
 #define bb_vector_new(T, L) ((T*)_bb_vector_new(sizeof(T), L))
 #define bb_vector_default(T) bb_vector_new(T, 0)
+void* _bb_vector_new_in(bb_arena_t arena, size_t item_size, size_t length);
+#define bb_vector_new_in(arena, T, L) \
+  ((T*)_bb_vector_new_in(arena, sizeof(T), L))
+#define bb_vector_default_in(arena, T) bb_vector_new_in(arena, T, 0)
 void* _bb_vector_push(void* vec, void* elem);
 #define bb_vector_push(vec, T, elem)    \
   do {                                  \
     T elem2 = elem;                     \
     vec = _bb_vector_push(vec, &elem2); \
   } while (0)
+void* _bb_vector_reserve(void* vec, size_t capacity);
+#define bb_vector_reserve(vec, capacity) \
+  ((vec) = _bb_vector_reserve(vec, capacity))
+void* _bb_vector_extend(void* vec, const void* elems, size_t count);
+#define bb_vector_extend(vec, elems, count) \
+  ((vec) = _bb_vector_extend(vec, elems, count))
+void* _bb_vector_insert(void* vec, size_t index, void* elem);
+#define bb_vector_insert(vec, T, index, elem)    \
+  do {                                           \
+    T elem2 = elem;                              \
+    vec = _bb_vector_insert(vec, index, &elem2); \
+  } while (0)
+void bb_vector_remove(void* vec, size_t index);
+void bb_vector_swap_remove(void* vec, size_t index);
+void bb_vector_clear(void* vec);
 long bb_vector_pop(void* vec, void* elem);
 size_t bb_vector_length(void* vec);
 size_t bb_vector_capacity(void* vec);
 void _bb_vector_destroy(void** vec);
 #define bb_vector_destroy(vec_ref) _bb_vector_destroy((void**)vec_ref)
 
-static inline char* bb_strdup(const char* s) {
-  char* duped;
-  bb_assert(s != NULL);
-  duped = strdup(s);
-  bb_assert(duped != NULL);
-  return duped;
-}
+bb_map_t _bb_map_new(size_t value_size);
+#define bb_map_new(T) _bb_map_new(sizeof(T))
+uint64_t bb_map_hash(const void* key, size_t key_size);
+void* bb_map_find(bb_map_t map, const void* key, size_t key_size);
+void* bb_map_find_hashed(bb_map_t map, const void* key, size_t key_size,
+                         uint64_t hash);
+void* bb_map_find_cstr(bb_map_t map, const char* key);
+void* bb_map_insert(bb_map_t map, const void* key, size_t key_size,
+                    const void* value);
+void* bb_map_insert_hashed(bb_map_t map, const void* key, size_t key_size,
+                           uint64_t hash, const void* value);
+void* bb_map_insert_cstr(bb_map_t map, const char* key, const void* value);
+int bb_map_remove(bb_map_t map, const void* key, size_t key_size);
+int bb_map_remove_cstr(bb_map_t map, const char* key);
+int bb_map_next(bb_map_t map, size_t* iter, const char** key, void** value);
+size_t bb_map_length(bb_map_t map);
+void bb_map_destroy(bb_map_t* map);
+
+#ifdef BB_ALLOC_STATS
+typedef struct {
+  size_t mallocs;   // Including bb_zalloc(..) and bb_strdup(..).
+  size_t reallocs;
+  size_t frees;
+  size_t allocated; // Total number of bytes requested.
+  size_t in_use;    // Number of bytes allocated and not freed yet.
+  size_t peak;      // Highest value of in_use.
+} bb_alloc_stats_t;
+
+void bb_alloc_stats(bb_alloc_stats_t* stats);
+void bb_alloc_stats_print(void);
+
+// With BB_ALLOC_STATS, every allocation goes through these, which keep the
+// counters up to date and count reallocs by call site.
+void* _bb_alloc_stats_malloc(size_t size);
+void* _bb_alloc_stats_realloc(void* buffer, size_t size,
+                              const char* file, int line);
+void _bb_alloc_stats_free(void* buffer);
+# define _BB_MALLOC(size) _bb_alloc_stats_malloc(size)
+# define _BB_REALLOC(buffer, size, file, line) \
+    _bb_alloc_stats_realloc(buffer, size, file, line)
+# define _BB_FREE(buffer) _bb_alloc_stats_free(buffer)
+#else
+# define _BB_MALLOC(size) BB_MALLOC(size)
+# define _BB_REALLOC(buffer, size, file, line) BB_REALLOC(buffer, size)
+# define _BB_FREE(buffer) BB_FREE(buffer)
+#endif
 
 static inline void* bb_malloc(size_t size) {
   void* buffer;
   bb_assert(size > 0);
-  buffer = malloc(size);
+  buffer = _BB_MALLOC(size);
   bb_assert(buffer != NULL);
   return buffer;
 }
@@ -185,18 +460,34 @@ static inline void* bb_zalloc(size_t size) {
   return buffer;
 }
 
-static inline void* bb_realloc(void* buffer, size_t size) {
+static inline char* bb_strdup(const char* s) {
+  size_t size;
+  char* duped;
+  bb_assert(s != NULL);
+  size = strlen(s) + 1;
+  duped = bb_malloc(size);
+  memcpy(duped, s, size);
+  return duped;
+}
+
+static inline void* _bb_realloc(void* buffer, size_t size,
+                                const char* file, int line) {
   bb_assert(size > 0);       // Do not allow free() by realloc().
   bb_assert(buffer != NULL); // Do not allow malloc() by realloc().
-  buffer = realloc(buffer, size);
+  BB_UNUSED(file);
+  BB_UNUSED(line);
+  buffer = _BB_REALLOC(buffer, size, file, line);
   bb_assert(buffer != NULL);
   return buffer;
 }
 
+#define bb_realloc(buffer, size) \
+  _bb_realloc(buffer, size, __FILE__, __LINE__)
+
 static inline void _bb_free(void** buffer) {
   bb_assert(buffer != NULL);
   bb_assert(*buffer != NULL);
-  free(*buffer);
+  _BB_FREE(*buffer);
   *buffer = NULL;
 }
 
@@ -207,6 +498,7 @@ char* bb_path(const char* path);
 #else
 #define bb_path(x) bb_strdup(x)
 #endif
+char* bb_path_in(bb_arena_t arena, const char* path);
 
 int bb_main(void);
 
@@ -216,10 +508,55 @@ int bb_main(void);
 # define BB_SOURCE "bb.c"
 #endif
 
+#ifndef BB_DB_PATH
+# define BB_DB_PATH ".bb/db"
+#endif
+
+// Files at least this big are memory-mapped by bb_file_view_open(..),
+// smaller ones are read into a buffer.
+#ifndef BB_FILE_MMAP_THRESHOLD
+# define BB_FILE_MMAP_THRESHOLD (64 << 10)
+#endif
+
+// How long --watch waits for more changes, after a file changed.
+#ifndef BB_WATCH_DEBOUNCE_MS
+# define BB_WATCH_DEBOUNCE_MS 50
+#endif
+
+// Number of commands listed in the resource usage summary, by default.
+#ifndef BB_USAGE_TOP
+# define BB_USAGE_TOP 5
+#endif
+
+// With memory pressure watching, no more jobs are started while less than
+// this much memory (in bytes, plus what the job is expected to use) is
+// available, or while tasks were stalled on memory for more than
+// BB_MEMORY_PRESSURE_MAX percent of the last 10 seconds.
+#ifndef BB_MEMORY_RESERVE
+# define BB_MEMORY_RESERVE ((uint64_t)256 << 20)
+#endif
+#ifndef BB_MEMORY_PRESSURE_MAX
+# define BB_MEMORY_PRESSURE_MAX 10.0
+#endif
+
+// Default size limit of the compilation cache.
+#ifndef BB_CACHE_MAX_SIZE
+# define BB_CACHE_MAX_SIZE ((uint64_t)1 << 30)
+#endif
+
+#ifndef BB_ARENA_BLOCK_SIZE
+# define BB_ARENA_BLOCK_SIZE (64 << 10)
+#endif
+
+#ifndef BB_FILE_COPY_BUFFER_SIZE
+# define BB_FILE_COPY_BUFFER_SIZE (1 << 20)
+#endif
+
 #ifndef BB_REBUILD_ARGS
 # if defined(__GNUC__) || defined(__clang__)
 #   define BB_REBUILD_ARGS \
-      BB_DISABLE_COLORS "-o", "bb", "-ggdb", "-Wall", "-Werror", BB_SOURCE
+      BB_DISABLE_COLORS "-o", "bb", "-ggdb", "-Wall", "-Werror", "-pthread", \
+      BB_SOURCE
 # elif defined(_MSC_VER)
 #   define BB_REBUILD_ARGS \
       BB_DISABLE_COLORS "-out:bb", "-Wall", "-WX", BB_SOURCE
@@ -234,24 +571,179 @@ int bb_main(void);
 #include <ctype.h>
 
 #if defined(BB_PLATFORM_LINUX) || defined(BB_PLATFORM_APPLE)
+# include <sys/mman.h>
 # include <sys/stat.h>
 # include <sys/wait.h>
+# include <sys/resource.h>
+# include <sys/file.h>
 # include <unistd.h>
 # include <dirent.h>
 # include <errno.h>
 # include <fcntl.h>
+# include <poll.h>
+# include <pthread.h>
+# include <time.h>
+# ifdef BB_PLATFORM_LINUX
+#   include <sys/inotify.h>
+#   include <sys/ioctl.h>
+#   include <sys/sendfile.h>
+#   include <sys/syscall.h>
+#   include <linux/fs.h>
+# endif
+# ifndef BB_USE_FORK
+#   include <spawn.h>
+# endif
+extern char** environ;
 #endif
 
 #define BB_UNIMPLEMENTED_STUB() \
   bb_crit("%s() unimplemented for this platform", __func__)
 
+// NOTE: The header is 32 bytes long, so that the items are as aligned as
+//       the allocation.
 typedef struct {
-  unsigned int capacity;
-  unsigned int length;
+  bb_arena_t arena;
+  size_t capacity;
+  size_t length;
   unsigned int item_size;
-  unsigned int checksum;
+  unsigned int checksum; // Only kept up to date if NDEBUG is not defined.
 } *_bb_vector_t;
 
+#ifdef BB_ALLOC_STATS
+// Every allocation is prefixed by its size, padded to keep the alignment
+// guaranteed by the allocator.
+#define _BB_ALLOC_HEADER_SIZE 16
+
+#ifndef BB_ALLOC_STATS_SITES
+# define BB_ALLOC_STATS_SITES 256
+#endif
+
+typedef struct {
+  const char* file;
+  int line;
+  size_t reallocs;
+} _bb_alloc_site_t;
+
+static bb_alloc_stats_t _bb_alloc_totals;
+// Open-addressed by line. If it is full, reallocs are still counted in the
+// totals, but not by call site.
+static _bb_alloc_site_t _bb_alloc_sites[BB_ALLOC_STATS_SITES];
+#ifndef BB_PLATFORM_WINDOWS
+// NOTE: Allocations may happen on many threads, e.g. when deleting.
+static pthread_mutex_t _bb_alloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static inline void _bb_alloc_lock(void) {
+#ifndef BB_PLATFORM_WINDOWS
+  pthread_mutex_lock(&_bb_alloc_mutex);
+#endif
+}
+
+static inline void _bb_alloc_unlock(void) {
+#ifndef BB_PLATFORM_WINDOWS
+  pthread_mutex_unlock(&_bb_alloc_mutex);
+#endif
+}
+
+static void _bb_alloc_count(size_t old_size, size_t new_size) {
+  _bb_alloc_totals.in_use += new_size - old_size;
+  if (new_size > old_size)
+    _bb_alloc_totals.allocated += new_size - old_size;
+  if (_bb_alloc_totals.in_use > _bb_alloc_totals.peak)
+    _bb_alloc_totals.peak = _bb_alloc_totals.in_use;
+}
+
+void* _bb_alloc_stats_malloc(size_t size) {
+  char* buffer = BB_MALLOC(size + _BB_ALLOC_HEADER_SIZE);
+  if (buffer == NULL)
+    return NULL;
+  *(size_t*)buffer = size;
+  _bb_alloc_lock();
+  ++_bb_alloc_totals.mallocs;
+  _bb_alloc_count(0, size);
+  _bb_alloc_unlock();
+  return buffer + _BB_ALLOC_HEADER_SIZE;
+}
+
+void* _bb_alloc_stats_realloc(void* buffer, size_t size,
+                              const char* file, int line) {
+  _bb_alloc_site_t* site;
+  size_t old_size;
+  char* header;
+
+  header = (char*)buffer - _BB_ALLOC_HEADER_SIZE;
+  old_size = *(size_t*)header;
+  header = BB_REALLOC(header, size + _BB_ALLOC_HEADER_SIZE);
+  if (header == NULL)
+    return NULL;
+  *(size_t*)header = size;
+
+  _bb_alloc_lock();
+  ++_bb_alloc_totals.reallocs;
+  _bb_alloc_count(old_size, size);
+  for (size_t i = 0; i < BB_ALLOC_STATS_SITES; ++i) {
+    site = &_bb_alloc_sites[(line + i) % BB_ALLOC_STATS_SITES];
+    if (site->file == NULL) {
+      site->file = file;
+      site->line = line;
+    } else if (site->line != line || strcmp(site->file, file))
+      continue;
+    ++site->reallocs;
+    break;
+  }
+  _bb_alloc_unlock();
+  return header + _BB_ALLOC_HEADER_SIZE;
+}
+
+void _bb_alloc_stats_free(void* buffer) {
+  char* header = (char*)buffer - _BB_ALLOC_HEADER_SIZE;
+  _bb_alloc_lock();
+  ++_bb_alloc_totals.frees;
+  _bb_alloc_count(*(size_t*)header, 0);
+  _bb_alloc_unlock();
+  BB_FREE(header);
+}
+
+void bb_alloc_stats(bb_alloc_stats_t* stats) {
+  bb_assert(stats != NULL);
+  _bb_alloc_lock();
+  *stats = _bb_alloc_totals;
+  _bb_alloc_unlock();
+}
+
+static int _bb_alloc_site_compare(const void* a, const void* b) {
+  const _bb_alloc_site_t* site_a = a;
+  const _bb_alloc_site_t* site_b = b;
+  if (site_a->reallocs != site_b->reallocs)
+    return site_a->reallocs < site_b->reallocs ? 1 : -1;
+  return site_a->line - site_b->line;
+}
+
+// Print the counters, and the call sites that reallocated the most.
+void bb_alloc_stats_print(void) {
+  _bb_alloc_site_t sites[BB_ALLOC_STATS_SITES];
+  bb_alloc_stats_t stats;
+  size_t n_sites = 0;
+
+  _bb_alloc_lock();
+  stats = _bb_alloc_totals;
+  for (size_t i = 0; i < BB_ALLOC_STATS_SITES; ++i) {
+    if (_bb_alloc_sites[i].file != NULL)
+      sites[n_sites++] = _bb_alloc_sites[i];
+  }
+  _bb_alloc_unlock();
+
+  bb_info("Allocations: %zu mallocs, %zu reallocs, %zu frees",
+          stats.mallocs, stats.reallocs, stats.frees);
+  bb_info("- %zu bytes allocated, %zu at peak, %zu still in use",
+          stats.allocated, stats.peak, stats.in_use);
+  qsort(sites, n_sites, sizeof(*sites), _bb_alloc_site_compare);
+  for (size_t i = 0; i < n_sites && i < 10; ++i)
+    bb_info("- %zu reallocs at %s:%d",
+            sites[i].reallocs, sites[i].file, sites[i].line);
+}
+#endif
+
 static inline unsigned int _bb_proc_id(bb_proc_t handle) {
 #ifdef BB_PLATFORM_WINDOWS
   return (unsigned int)GetProcessId(handle);
@@ -260,6 +752,20 @@ static inline unsigned int _bb_proc_id(bb_proc_t handle) {
 #endif
 }
 
+// Returns a monotonic timestamp in nanoseconds.
+static uint64_t _bb_time_ns(void) {
+#ifdef BB_PLATFORM_WINDOWS
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (uint64_t)(counter.QuadPart / (double)frequency.QuadPart * 1e9);
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
 static bb_string_t _bb_strerror(void) {
   bb_string_t error_str;
 #ifdef BB_PLATFORM_WINDOWS
@@ -278,15 +784,249 @@ static bb_string_t _bb_strerror(void) {
   return error_str;
 }
 
+// With tracing enabled, the commands run and the main phases of the build
+// are recorded as trace events, and written out (on exit, or by calling
+// bb_trace_write()) as JSON that chrome://tracing and Perfetto can load.
+// Commands run by job queues show up on the thread of their slot, the rest
+// on the main thread.
+// NOTE: Events are only recorded from the main thread.
+static struct {
+  char* path;          // NULL if tracing is disabled.
+  uint64_t epoch;      // Time of the first event, in nanoseconds.
+  bb_string_t events;  // Comma-separated events written so far.
+  unsigned int pid;
+  size_t max_tid;
+} _bb_trace;
+
+static void _bb_trace_concat_json(bb_string_t dst, const char* str) {
+  bb_string_append(dst, '"');
+  for (; *str != '\0'; ++str) {
+    if (*str == '"' || *str == '\\') {
+      bb_string_append(dst, '\\');
+      bb_string_append(dst, *str);
+    } else if ((unsigned char)*str < 0x20)
+      bb_string_appendf(dst, "\\u%04x", (unsigned int)*str);
+    else
+      bb_string_append(dst, *str);
+  }
+  bb_string_append(dst, '"');
+}
+
+// Record a complete event, from start to end. args, if not NULL, are the
+// members of its JSON arguments object.
+static void _bb_trace_span(const char* category, const char* name,
+                           size_t tid, uint64_t start, uint64_t end,
+                           const char* args) {
+  bb_string_t events = _bb_trace.events;
+
+  if (_bb_trace.path == NULL)
+    return;
+  if (events->length > 0)
+    bb_string_concat(events, ",\n");
+  bb_string_concat(events, "{\"name\":");
+  _bb_trace_concat_json(events, name);
+  bb_string_appendf(events, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%u,"
+                    "\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f",
+                    category, _bb_trace.pid, tid,
+                    (start - _bb_trace.epoch) / 1e3, (end - start) / 1e3);
+  if (args != NULL)
+    bb_string_appendf(events, ",\"args\":{%s}", args);
+  bb_string_append(events, '}');
+  if (tid > _bb_trace.max_tid)
+    _bb_trace.max_tid = tid;
+}
+
+// Record a span on the main thread, started by bb_trace_begin(), about
+// the file at path.
+static void _bb_trace_file(const char* name, uint64_t start,
+                           const char* path) {
+  bb_string_t args;
+
+  if (_bb_trace.path == NULL)
+    return;
+  args = bb_string_from_cstr("\"path\":");
+  _bb_trace_concat_json(args, path);
+  _bb_trace_span("file", name, 0, start, _bb_time_ns(), args->cstr);
+  bb_string_destroy(&args);
+}
+
+// Start tracing, to the JSON file at path.
+void bb_trace_enable(const char* path) {
+  bb_assert(path != NULL);
+  if (_bb_trace.path == NULL) {
+    _bb_trace.events = bb_string_default();
 #ifdef BB_PLATFORM_WINDOWS
-char* bb_path(const char* path) {
-  size_t path_len;
+    _bb_trace.pid = (unsigned int)GetCurrentProcessId();
+#else
+    _bb_trace.pid = (unsigned int)getpid();
+#endif
+    atexit(bb_trace_write);
+  } else
+    bb_free(&_bb_trace.path);
+  _bb_trace.path = bb_strdup(path);
+  if (_bb_trace.epoch == 0)
+    _bb_trace.epoch = _bb_time_ns();
+}
+
+// Write the events recorded so far. It's called on exit, but can be called
+// at any time.
+void bb_trace_write(void) {
+  bb_string_t error;
+  FILE* file;
+
+  if (_bb_trace.path == NULL)
+    return;
+  // NOTE: This may run on exit, so it must not exit on failure.
+  file = fopen(_bb_trace.path, "w");
+  if (file == NULL)
+    goto fail;
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":0,"
+          "\"args\":{\"name\":\"main\"}}", _bb_trace.pid);
+  for (size_t tid = 1; tid <= _bb_trace.max_tid; ++tid)
+    fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,"
+            "\"tid\":%zu,\"args\":{\"name\":\"slot %zu\"}}",
+            _bb_trace.pid, tid, tid);
+  if (_bb_trace.events->length > 0)
+    fputs(",\n", file);
+  fwrite(_bb_trace.events->cstr, 1, _bb_trace.events->length, file);
+  fputs("\n]}\n", file);
+  if (fclose(file) != 0)
+    goto fail;
+  return;
+
+fail:
+  error = _bb_strerror();
+  bb_warn("Could not write trace %s: %s", _bb_trace.path, error->cstr);
+  bb_string_destroy(&error);
+}
+
+// Returns the start time of a span, to pass to bb_trace_end(..), or 0 if
+// tracing is disabled.
+uint64_t bb_trace_begin(void) {
+  return _bb_trace.path != NULL ? _bb_time_ns() : 0;
+}
+
+// Record a span of the build script, on the main thread.
+void bb_trace_end(const char* name, uint64_t start) {
+  bb_assert(name != NULL);
+  if (_bb_trace.path != NULL && start != 0)
+    _bb_trace_span("user", name, 0, start, _bb_time_ns(), NULL);
+}
+
+// Every allocation is aligned to this, which is enough for any type.
+#define _BB_ARENA_ALIGN 16
+
+static inline char* _bb_arena_align(char* ptr) {
+  return (char*)(((uintptr_t)ptr + _BB_ARENA_ALIGN - 1) &
+                 ~(uintptr_t)(_BB_ARENA_ALIGN - 1));
+}
+
+// The arena allocates blocks of block_size bytes, or BB_ARENA_BLOCK_SIZE
+// if it is 0.
+bb_arena_t bb_arena_new(size_t block_size) {
+  bb_arena_t arena = bb_malloc(sizeof(*arena));
+  arena->block = NULL;
+  arena->block_size = block_size > 0 ? block_size : BB_ARENA_BLOCK_SIZE;
+  return arena;
+}
+
+void* bb_arena_alloc(bb_arena_t arena, size_t size) {
+  _bb_arena_block_t* block;
+  size_t block_size;
+  char* ptr;
+
+  bb_assert(arena != NULL);
+  bb_assert(size > 0);
+
+  block = arena->block;
+  if (block != NULL) {
+    ptr = _bb_arena_align(&block->data[block->used]);
+    if ((uintptr_t)ptr + size <= (uintptr_t)&block->data[block->size])
+      goto out;
+  }
+
+  // NOTE: Allocations bigger than a block get a block of their own.
+  block_size = size + _BB_ARENA_ALIGN - 1;
+  if (block_size < arena->block_size)
+    block_size = arena->block_size;
+  block = bb_malloc(sizeof(*block) + block_size);
+  block->prev = arena->block;
+  block->size = block_size;
+  arena->block = block;
+  ptr = _bb_arena_align(block->data);
+
+out:
+  block->used = ptr + size - block->data;
+  return ptr;
+}
+
+char* bb_arena_strdup(bb_arena_t arena, const char* s) {
+  size_t size;
+  char* duped;
+  bb_assert(s != NULL);
+  size = strlen(s) + 1;
+  duped = bb_arena_alloc(arena, size);
+  memcpy(duped, s, size);
+  return duped;
+}
+
+// Everything allocated after taking the mark is released by resetting the
+// arena to it. Marks can be nested, but must be reset in reverse order.
+bb_arena_mark_t bb_arena_mark(bb_arena_t arena) {
+  bb_arena_mark_t mark;
+  bb_assert(arena != NULL);
+  mark.block = arena->block;
+  mark.used = arena->block != NULL ? arena->block->used : 0;
+  return mark;
+}
+
+void bb_arena_reset(bb_arena_t arena, bb_arena_mark_t mark) {
+  _bb_arena_block_t* block;
+  bb_assert(arena != NULL);
+  while (arena->block != mark.block) {
+    // If this fails, the mark was taken on another arena or was reset.
+    bb_assert(arena->block != NULL);
+    block = arena->block;
+    if (block->prev == NULL) {
+      bb_assert(mark.block == NULL);
+      // NOTE: The first block is kept, so that an arena which is reset
+      //       after every step does not allocate a new block every time.
+      mark.used = 0;
+      break;
+    }
+    arena->block = block->prev;
+    bb_free(&block);
+  }
+  if (arena->block != NULL) {
+    bb_assert(mark.used <= arena->block->used);
+    arena->block->used = mark.used;
+  }
+}
+
+void bb_arena_destroy(bb_arena_t* arena) {
+  _bb_arena_block_t* block;
+  bb_assert(arena != NULL);
+  bb_assert(*arena != NULL);
+  while ((block = (*arena)->block) != NULL) {
+    (*arena)->block = block->prev;
+    bb_free(&block);
+  }
+  bb_free(arena);
+}
+
+// Like bb_path(..), but the path is allocated in the arena, if not NULL.
+char* bb_path_in(bb_arena_t arena, const char* path) {
+#ifdef BB_PLATFORM_WINDOWS
+  size_t path_len, size;
   char* str;
   bb_assert(path != NULL);
   path_len = strlen(path);
   if (path_len == 0)
     return path;
-  str = bb_zalloc(path_len + 1 + ((path[0] == '/') << 1));
+  size = path_len + 1 + ((path[0] == '/') << 1);
+  str = arena != NULL ? bb_arena_alloc(arena, size) : bb_malloc(size);
+  memset(str, 0, size);
   // If the UNIX path is absolute, make the Windows path
   // start with 'C:'.
   if (path[0] == '/') {
@@ -300,12 +1040,298 @@ char* bb_path(const char* path) {
       *ptr = '\\';
   }
   return str;
+#else
+  return arena != NULL ? bb_arena_strdup(arena, path) : bb_strdup(path);
+#endif
+}
+
+#ifdef BB_PLATFORM_WINDOWS
+char* bb_path(const char* path) {
+  return bb_path_in(NULL, path);
 }
 #endif
 
-static time_t _bb_file_last_modification_time(const char* path,
-                                              int fail_on_err) {
-  bb_string_t error;
+static uint64_t _bb_hash(const void* data, size_t size, uint64_t seed) {
+  // MurmurHash64A
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  const unsigned char* bytes = data;
+  const unsigned char* end = bytes + (size & ~(size_t)7);
+  uint64_t k, h = seed ^ (size * m);
+
+  for (; bytes != end; bytes += 8) {
+    memcpy(&k, bytes, sizeof(k));
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  switch (size & 7) {
+    case 7: h ^= (uint64_t)bytes[6] << 48; // fall through
+    case 6: h ^= (uint64_t)bytes[5] << 40; // fall through
+    case 5: h ^= (uint64_t)bytes[4] << 32; // fall through
+    case 4: h ^= (uint64_t)bytes[3] << 24; // fall through
+    case 3: h ^= (uint64_t)bytes[2] << 16; // fall through
+    case 2: h ^= (uint64_t)bytes[1] << 8;  // fall through
+    case 1: h ^= (uint64_t)bytes[0];
+            h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+static inline uint64_t _bb_hash_cstr(const char* cstr, uint64_t seed) {
+  return _bb_hash(cstr, strlen(cstr), seed);
+}
+
+#ifndef BB_MAP_MIN_CAPACITY
+# define BB_MAP_MIN_CAPACITY 16
+#endif
+
+typedef struct {
+  uint64_t hash;   // 0 if the slot is empty.
+  const char* key; // NUL-terminated, even if it is not a string.
+  size_t key_size;
+} _bb_map_slot_t;
+
+static inline _bb_map_slot_t* _bb_map_slot(bb_map_t map, size_t i) {
+  return (_bb_map_slot_t*)(map->slots + i * map->stride);
+}
+
+static inline void* _bb_map_value(_bb_map_slot_t* slot) {
+  return slot + 1;
+}
+
+// How far a slot is from where its hash would put it.
+static inline size_t _bb_map_distance(bb_map_t map, size_t i,
+                                      uint64_t hash) {
+  return (i - hash) & (map->capacity - 1);
+}
+
+static void _bb_map_alloc_slots(bb_map_t map, size_t capacity) {
+  map->capacity = capacity;
+  map->slots = bb_zalloc(capacity * map->stride);
+}
+
+// The map uses Robin Hood hashing: slots are probed linearly, and an entry
+// takes the slot of any entry closer to its own ideal slot. This keeps the
+// probe sequences short even with a high load factor, and lets lookups of
+// missing keys stop early.
+bb_map_t _bb_map_new(size_t value_size) {
+  bb_map_t map = bb_malloc(sizeof(*map));
+  map->length = 0;
+  map->value_size = value_size;
+  // NOTE: Values are aligned like the slots, which is enough for pointers
+  //       and 64-bit integers.
+  map->stride = (sizeof(_bb_map_slot_t) + value_size + 7) & ~(size_t)7;
+  map->scratch = bb_malloc(map->stride << 1);
+  map->keys = bb_arena_new(0);
+  _bb_map_alloc_slots(map, BB_MAP_MIN_CAPACITY);
+  return map;
+}
+
+uint64_t bb_map_hash(const void* key, size_t key_size) {
+  uint64_t hash;
+  bb_assert(key != NULL || key_size == 0);
+  hash = _bb_hash(key, key_size, 0);
+  // NOTE: 0 marks empty slots.
+  return hash != 0 ? hash : 1;
+}
+
+void* bb_map_find_hashed(bb_map_t map, const void* key, size_t key_size,
+                         uint64_t hash) {
+  _bb_map_slot_t* slot;
+  size_t i, distance;
+
+  bb_assert(map != NULL);
+  bb_assert(key != NULL || key_size == 0);
+  bb_assert(hash != 0);
+
+  i = hash & (map->capacity - 1);
+  for (distance = 0;; ++distance, i = (i + 1) & (map->capacity - 1)) {
+    slot = _bb_map_slot(map, i);
+    // NOTE: If the key was in the map, it would have taken this slot.
+    if (slot->hash == 0 || _bb_map_distance(map, i, slot->hash) < distance)
+      return NULL;
+    if (slot->hash == hash && slot->key_size == key_size &&
+        !memcmp(slot->key, key, key_size))
+      return _bb_map_value(slot);
+  }
+}
+
+void* bb_map_find(bb_map_t map, const void* key, size_t key_size) {
+  return bb_map_find_hashed(map, key, key_size, bb_map_hash(key, key_size));
+}
+
+void* bb_map_find_cstr(bb_map_t map, const char* key) {
+  bb_assert(key != NULL);
+  return bb_map_find(map, key, strlen(key));
+}
+
+// Put the slot in scratch into the map, which must not contain its key.
+// Returns where it ended up.
+static _bb_map_slot_t* _bb_map_place(bb_map_t map) {
+  _bb_map_slot_t *slot, *entry, *placed = NULL;
+  char* tmp;
+  size_t i, distance, slot_distance;
+
+  entry = (_bb_map_slot_t*)map->scratch;
+  tmp = map->scratch + map->stride;
+  i = entry->hash & (map->capacity - 1);
+  for (distance = 0;; ++distance, i = (i + 1) & (map->capacity - 1)) {
+    slot = _bb_map_slot(map, i);
+    if (slot->hash == 0) {
+      memcpy(slot, entry, map->stride);
+      return placed != NULL ? placed : slot;
+    }
+    slot_distance = _bb_map_distance(map, i, slot->hash);
+    if (slot_distance < distance) {
+      // Take the slot, and go on placing the entry that was there.
+      memcpy(tmp, slot, map->stride);
+      memcpy(slot, entry, map->stride);
+      memcpy(entry, tmp, map->stride);
+      if (placed == NULL)
+        placed = slot;
+      distance = slot_distance;
+    }
+  }
+}
+
+static void _bb_map_grow(bb_map_t map) {
+  char* old_slots = map->slots;
+  size_t old_capacity = map->capacity;
+  _bb_map_slot_t* slot;
+
+  _bb_map_alloc_slots(map, old_capacity << 1);
+  for (size_t i = 0; i < old_capacity; ++i) {
+    slot = (_bb_map_slot_t*)(old_slots + i * map->stride);
+    if (slot->hash == 0)
+      continue;
+    memcpy(map->scratch, slot, map->stride);
+    _bb_map_place(map);
+  }
+  bb_free(&old_slots);
+}
+
+// Insert or replace the value of key. If value is NULL, the value is
+// zeroed. Returns where the value is stored, until the map is changed.
+void* bb_map_insert_hashed(bb_map_t map, const void* key, size_t key_size,
+                           uint64_t hash, const void* value) {
+  _bb_map_slot_t* slot;
+  char* key_copy;
+  void* found;
+
+  found = bb_map_find_hashed(map, key, key_size, hash);
+  if (found == NULL) {
+    // Keep the load factor under 7/8.
+    if ((map->length + 1) << 3 > map->capacity * 7)
+      _bb_map_grow(map);
+    key_copy = bb_arena_alloc(map->keys, key_size + 1);
+    memcpy(key_copy, key, key_size);
+    key_copy[key_size] = '\0';
+    slot = (_bb_map_slot_t*)map->scratch;
+    slot->hash = hash;
+    slot->key = key_copy;
+    slot->key_size = key_size;
+    found = _bb_map_value(_bb_map_place(map));
+    ++map->length;
+  }
+
+  if (value != NULL)
+    memcpy(found, value, map->value_size);
+  else
+    memset(found, 0, map->value_size);
+  return found;
+}
+
+void* bb_map_insert(bb_map_t map, const void* key, size_t key_size,
+                    const void* value) {
+  return bb_map_insert_hashed(map, key, key_size,
+                              bb_map_hash(key, key_size), value);
+}
+
+void* bb_map_insert_cstr(bb_map_t map, const char* key, const void* value) {
+  bb_assert(key != NULL);
+  return bb_map_insert(map, key, strlen(key), value);
+}
+
+// Returns BB_FALSE if the key was not in the map.
+// NOTE: The memory of the key is only released when the map is destroyed.
+int bb_map_remove(bb_map_t map, const void* key, size_t key_size) {
+  _bb_map_slot_t *slot, *next;
+  size_t i, mask;
+  void* value;
+
+  value = bb_map_find(map, key, key_size);
+  if (value == NULL)
+    return BB_FALSE;
+
+  // Move the following entries back by one slot, until one is already in
+  // its ideal slot.
+  mask = map->capacity - 1;
+  slot = (_bb_map_slot_t*)value - 1;
+  i = ((char*)slot - map->slots) / map->stride;
+  for (;; i = (i + 1) & mask) {
+    next = _bb_map_slot(map, (i + 1) & mask);
+    if (next->hash == 0 ||
+        _bb_map_distance(map, (i + 1) & mask, next->hash) == 0)
+      break;
+    memcpy(_bb_map_slot(map, i), next, map->stride);
+  }
+  memset(_bb_map_slot(map, i), 0, map->stride);
+  --map->length;
+  return BB_TRUE;
+}
+
+int bb_map_remove_cstr(bb_map_t map, const char* key) {
+  bb_assert(key != NULL);
+  return bb_map_remove(map, key, strlen(key));
+}
+
+// Iterate over the entries, in no particular order. Set *iter to 0 to
+// start; returns BB_FALSE when there are no more entries. The map must
+// not be changed while iterating.
+int bb_map_next(bb_map_t map, size_t* iter, const char** key, void** value) {
+  _bb_map_slot_t* slot;
+  bb_assert(map != NULL);
+  bb_assert(iter != NULL);
+  for (; *iter < map->capacity; ++*iter) {
+    slot = _bb_map_slot(map, *iter);
+    if (slot->hash == 0)
+      continue;
+    ++*iter;
+    if (key != NULL)
+      *key = slot->key;
+    if (value != NULL)
+      *value = _bb_map_value(slot);
+    return BB_TRUE;
+  }
+  return BB_FALSE;
+}
+
+size_t bb_map_length(bb_map_t map) {
+  bb_assert(map != NULL);
+  return map->length;
+}
+
+void bb_map_destroy(bb_map_t* map) {
+  bb_assert(map != NULL);
+  bb_assert(*map != NULL);
+  bb_free(&(*map)->slots);
+  bb_free(&(*map)->scratch);
+  bb_arena_destroy(&(*map)->keys);
+  bb_free(map);
+}
+
+// Fills in the modification time (in nanoseconds), the size and the type
+// of a file. Returns BB_FALSE, with errno set, if it does not exist.
+static int _bb_file_stat(const char* path, time_t* mtime, uint64_t* size,
+                         int* is_dir) {
   bb_assert(path != NULL);
 #ifdef BB_PLATFORM_WINDOWS
   WIN32_FILE_ATTRIBUTE_DATA file_attr_data;
@@ -319,16 +1345,256 @@ static time_t _bb_file_last_modification_time(const char* path,
     time = &file_attr_data.ftLastWriteTime;
     time_full.u.LowPart = time->dwLowDateTime;
     time_full.u.HighPart = time->dwHighDateTime;
-    return time_full.QuadPart * 1e2;
+    *mtime = time_full.QuadPart * 1e2;
+    *size = ((uint64_t)file_attr_data.nFileSizeHigh << 32)
+          | file_attr_data.nFileSizeLow;
+    *is_dir = (file_attr_data.dwFileAttributes &
+               FILE_ATTRIBUTE_DIRECTORY) != 0;
+    return BB_TRUE;
   }
+  bb_free(&windows_path);
 #else
   struct stat info;
   // NOTE: We do not use bb_path(..) here since this code will be run
   // only on *NIX systems, therefore the path will already be in the
   // correct form.
-  if (stat(path, &info) == 0)
-    return info.st_mtim.tv_sec * 1e9 + info.st_mtim.tv_nsec;
+  if (stat(path, &info) == 0) {
+    *mtime = info.st_mtim.tv_sec * 1e9 + info.st_mtim.tv_nsec;
+    *size = info.st_size;
+    *is_dir = S_ISDIR(info.st_mode);
+    return BB_TRUE;
+  }
+#endif
+  return BB_FALSE;
+}
+
+// The stat cache remembers what every path looked like the last time it
+// was stat'ed during this run, so the same headers and directories are
+// not queried over and over. Entries are invalidated when bb writes or
+// deletes a file, when a rule producing a file runs, and, for the files
+// under the working directory, when a command with unknown effects is run.
+typedef struct {
+  char* path;
+  int valid;
+  int exists;
+  int error;  // errno from stat(..), if the file does not exist.
+  int is_dir;
+  time_t mtime;
+  uint64_t size;
+} *_bb_stat_t;
+
+static struct {
+  bb_map_t index; // Paths to their entry.
+  _bb_stat_t* entries;
+  size_t hits;
+  size_t misses;
+} _bb_stat_cache;
+
+static _bb_stat_t _bb_stat(const char* path) {
+  _bb_stat_t entry;
+  size_t *id, length;
+  uint64_t hash;
+
+  bb_assert(path != NULL);
+
+  if (_bb_stat_cache.index == NULL) {
+    _bb_stat_cache.index = bb_map_new(size_t);
+    _bb_stat_cache.entries = bb_vector_default(_bb_stat_t);
+  }
+
+  length = strlen(path);
+  hash = bb_map_hash(path, length);
+  id = bb_map_find_hashed(_bb_stat_cache.index, path, length, hash);
+  if (id != NULL) {
+    entry = _bb_stat_cache.entries[*id];
+    if (entry->valid) {
+      ++_bb_stat_cache.hits;
+      return entry;
+    }
+  } else {
+    entry = bb_malloc(sizeof(*entry));
+    entry->path = bb_strdup(path);
+    bb_vector_push(_bb_stat_cache.entries, _bb_stat_t, entry);
+    *(size_t*)bb_map_insert_hashed(_bb_stat_cache.index, path, length,
+                                   hash, NULL) =
+      bb_vector_length(_bb_stat_cache.entries) - 1;
+  }
+
+  ++_bb_stat_cache.misses;
+  entry->exists = _bb_file_stat(path, &entry->mtime, &entry->size,
+                                &entry->is_dir);
+  entry->error = entry->exists ? 0 : errno;
+  if (!entry->exists) {
+    entry->mtime = entry->size = 0;
+    entry->is_dir = BB_FALSE;
+  }
+  entry->valid = BB_TRUE;
+  return entry;
+}
+
+// Forget what is known about path, and about everything under it if
+// recursive is set. If path is NULL, the whole cache is invalidated.
+static void _bb_stat_invalidate(const char* path, int recursive) {
+  _bb_stat_t entry;
+  size_t* id;
+  size_t length;
+
+  if (_bb_stat_cache.index == NULL)
+    return;
+
+  if (path != NULL && !recursive) {
+    id = bb_map_find_cstr(_bb_stat_cache.index, path);
+    if (id != NULL)
+      _bb_stat_cache.entries[*id]->valid = BB_FALSE;
+    return;
+  }
+
+  length = path != NULL ? strlen(path) : 0;
+  for (size_t i = 0; i < bb_vector_length(_bb_stat_cache.entries); ++i) {
+    entry = _bb_stat_cache.entries[i];
+    if (path == NULL ||
+        (!strncmp(entry->path, path, length) &&
+         (entry->path[length] == '\0' || entry->path[length] == '/')))
+      entry->valid = BB_FALSE;
+  }
+}
+
+// Forget what is known about the paths under the working directory, where
+// commands with unknown effects are expected to write. Files they write
+// elsewhere must be passed to bb_file_invalidate(..).
+static void _bb_stat_invalidate_cwd(void) {
+#ifdef BB_PLATFORM_WINDOWS
+  _bb_stat_invalidate(NULL, BB_TRUE);
+#else
+  _bb_stat_t entry;
+  const char* path;
+  char cwd[4096];
+  size_t length;
+  int under;
+
+  if (_bb_stat_cache.index == NULL)
+    return;
+  if (getcwd(cwd, sizeof(cwd)) == NULL) {
+    _bb_stat_invalidate(NULL, BB_TRUE);
+    return;
+  }
+
+  length = strlen(cwd);
+  for (size_t i = 0; i < bb_vector_length(_bb_stat_cache.entries); ++i) {
+    entry = _bb_stat_cache.entries[i];
+    path = entry->path;
+    if (path[0] != '/')
+      under = strncmp(path, "..", 2) || (path[2] != '\0' && path[2] != '/');
+    else
+      under = !strncmp(path, cwd, length) &&
+              (length == 1 || path[length] == '\0' || path[length] == '/');
+    if (under)
+      entry->valid = BB_FALSE;
+  }
+#endif
+}
+
+// Tell bb that a file was changed behind its back. If path is a directory,
+// everything under it is invalidated too; if it's NULL, everything is.
+void bb_file_invalidate(const char* path) {
+  char* path2;
+  if (path == NULL) {
+    _bb_stat_invalidate(NULL, BB_TRUE);
+    return;
+  }
+  path2 = bb_path(path);
+  _bb_stat_invalidate(path2, BB_TRUE);
+  bb_free(&path2);
+}
+
+void bb_file_cache_stats(size_t* hits, size_t* misses) {
+  if (hits != NULL)
+    *hits = _bb_stat_cache.hits;
+  if (misses != NULL)
+    *misses = _bb_stat_cache.misses;
+}
+
+// State of --watch mode. Inputs are registered as builds use them, and the
+// directories containing them are watched, rather than the files, so that
+// files replaced by editors (written elsewhere and renamed) are noticed.
+static struct {
+  int active;
+  int fd;             // The inotify instance.
+  bb_map_t paths;     // Watched files.
+  bb_map_t dirs;      // Watched directories, to their watch descriptor.
+  char** wd_dirs;     // Directory of each watch descriptor, or NULL.
+  char** strings;     // Owns the directories in wd_dirs.
+} _bb_watch;
+
+static void _bb_watch_add(const char* path) {
+  const char* sep;
+  char* dir;
+  int wd;
+
+  if (!_bb_watch.active || bb_map_find_cstr(_bb_watch.paths, path) != NULL)
+    return;
+#ifdef BB_PLATFORM_LINUX
+  bb_map_insert_cstr(_bb_watch.paths, path, NULL);
+
+  sep = strrchr(path, '/');
+  if (sep == NULL)
+    dir = bb_strdup(".");
+  else {
+    if (sep == path)
+      ++sep; // Keep the root directory.
+    dir = bb_malloc(sep - path + 1);
+    memcpy(dir, path, sep - path);
+    dir[sep - path] = '\0';
+  }
+  if (bb_map_find_cstr(_bb_watch.dirs, dir) != NULL) {
+    bb_free(&dir);
+    return;
+  }
+
+  wd = inotify_add_watch(_bb_watch.fd, dir,
+                         IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                         IN_MOVED_FROM | IN_MOVED_TO);
+  bb_map_insert_cstr(_bb_watch.dirs, dir, &wd);
+  if (wd < 0) {
+    bb_string_t error = _bb_strerror();
+    bb_warn("Could not watch directory %s: %s", dir, error->cstr);
+    bb_string_destroy(&error);
+    bb_free(&dir);
+    return;
+  }
+  while (bb_vector_length(_bb_watch.wd_dirs) <= (size_t)wd)
+    bb_vector_push(_bb_watch.wd_dirs, char*, NULL);
+  // NOTE: The same directory may be spelled in different ways, events
+  //       are reported with the first one.
+  if (_bb_watch.wd_dirs[wd] == NULL) {
+    _bb_watch.wd_dirs[wd] = dir;
+    bb_vector_push(_bb_watch.strings, char*, dir);
+  } else
+    bb_free(&dir);
 #endif
+}
+
+// Returns BB_TRUE and fills in the modification time (in nanoseconds)
+// and the size of the file, if it exists.
+static int _bb_file_get_info(const char* path, time_t* mtime,
+                             uint64_t* size) {
+  _bb_stat_t entry = _bb_stat(path);
+  if (!entry->exists) {
+    errno = entry->error;
+    return BB_FALSE;
+  }
+  *mtime = entry->mtime;
+  *size = entry->size;
+  return BB_TRUE;
+}
+
+static time_t _bb_file_last_modification_time(const char* path,
+                                              int fail_on_err) {
+  bb_string_t error;
+  time_t mtime;
+  uint64_t size;
+  if (_bb_file_get_info(path, &mtime, &size))
+    return mtime;
   if (fail_on_err) {
     error = _bb_strerror();
     bb_crit("Could not get access time for %s: %s", path, error->cstr);
@@ -336,9 +1602,401 @@ static time_t _bb_file_last_modification_time(const char* path,
   return 0;
 }
 
+#ifndef BB_PLATFORM_WINDOWS
+// Read exactly size bytes from fd. Returns BB_FALSE on failure, or if the
+// file is shorter than expected.
+static int _bb_fd_read_all(int fd, void* buffer, size_t size) {
+  ssize_t n;
+  for (size_t off = 0; off < size; off += n) {
+    n = read(fd, (char*)buffer + off, size - off);
+    if (n < 0 && errno == EINTR)
+      n = 0;
+    else if (n <= 0)
+      return BB_FALSE;
+  }
+  return BB_TRUE;
+}
+#endif
+
+// Same as bb_file_view_open(..), but returns NULL (with errno set) if the
+// file cannot be read.
+static bb_file_view_t _bb_file_view_open(const char* path) {
+  bb_file_view_t view;
+  bb_assert(path != NULL);
+#ifdef BB_PLATFORM_WINDOWS
+  BB_UNIMPLEMENTED_STUB();
+#else
+  struct stat info;
+  void* data;
+  int fd, saved_errno;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &info) < 0)
+    goto fail;
+
+  view = bb_malloc(sizeof(*view));
+  view->size = info.st_size;
+  view->mapped = info.st_size >= BB_FILE_MMAP_THRESHOLD;
+  if (view->mapped) {
+    data = mmap(NULL, view->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      bb_free(&view);
+      goto fail;
+    }
+    // NOTE: Views are usually scanned from start to end.
+    madvise(data, view->size, MADV_SEQUENTIAL);
+  } else {
+    // NOTE: Empty views still point to a valid buffer.
+    data = bb_malloc(view->size + 1);
+    if (!_bb_fd_read_all(fd, data, view->size)) {
+      bb_free(&data);
+      bb_free(&view);
+      goto fail;
+    }
+  }
+  view->data = data;
+  close(fd);
+  return view;
+
+fail:
+  saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return NULL;
+#endif
+}
+
+// Open a read-only view of the contents of a file, without copying it
+// when it is large. The file should not be modified while it is viewed.
+bb_file_view_t bb_file_view_open(const char* path) {
+  bb_file_view_t view;
+  bb_string_t error;
+  char* path2;
+
+  bb_assert(path != NULL);
+  path2 = bb_path(path);
+  view = _bb_file_view_open(path2);
+  if (view == NULL) {
+    error = _bb_strerror();
+    bb_crit("Could not read file %s: %s", path2, error->cstr);
+  }
+  bb_free(&path2);
+  return view;
+}
+
+void bb_file_view_close(bb_file_view_t* view) {
+  bb_assert(view != NULL);
+  bb_assert(*view != NULL);
+#ifdef BB_PLATFORM_WINDOWS
+  BB_UNIMPLEMENTED_STUB();
+#else
+  if ((*view)->mapped)
+    munmap((void*)(*view)->data, (*view)->size);
+  else
+    bb_free((void**)&(*view)->data);
+#endif
+  bb_free(view);
+}
+
+// Hash the contents of a file. Returns BB_FALSE if it cannot be read.
+static int _bb_file_hash(const char* path, uint64_t* hash) {
+  bb_file_view_t view;
+  bb_assert(path != NULL);
+  bb_assert(hash != NULL);
+  view = _bb_file_view_open(path);
+  if (view == NULL)
+    return BB_FALSE;
+  *hash = _bb_hash(view->data, view->size, 0);
+  bb_file_view_close(&view);
+  return BB_TRUE;
+}
+
+// The build database is a sorted table of (key, blob) pairs, that is
+// memory-mapped when opened. Updates are kept in memory and merged into
+// a new file when the database is closed.
+#define _BB_DB_MAGIC "BBDB"
+#define _BB_DB_VERSION 1
+
+// Seeds used to derive the keys of the different kinds of records.
+enum {
+  _BB_DB_KEY_TARGET = 1,
+  _BB_DB_KEY_DEPS,
+  _BB_DB_KEY_MEMORY, // Peak memory the rule used when it last ran.
+  _BB_DB_KEY_REBUILD  // How BB_SOURCE was last built into bb itself.
+};
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t count;
+} _bb_db_header_t;
+
+typedef struct {
+  uint64_t key;
+  uint64_t offset;
+  uint64_t size;
+} _bb_db_entry_t;
+
+typedef struct {
+  uint64_t key;
+  size_t order;
+  size_t size;
+  void* blob;
+} _bb_db_update_t;
+
+typedef struct {
+  char* path;
+  void* map;
+  size_t map_size;
+  const _bb_db_entry_t* entries;
+  size_t count;
+  _bb_db_update_t* updates;
+} *_bb_db_t;
+
+// A record describing how a target was last built.
+typedef struct {
+  uint64_t path;  // Hash of the input path.
+  int64_t mtime;
+  uint64_t size;
+  uint64_t hash;  // Hash of the input contents.
+} _bb_db_input_t;
+
+typedef struct {
+  uint64_t cmd;
+  uint64_t count;
+  _bb_db_input_t inputs[];
+} _bb_db_target_t;
+
+// A record holding the prerequisites parsed from a depfile.
+typedef struct {
+  int64_t mtime;
+  uint64_t size;
+  uint64_t count;
+  char paths[];   // NUL-terminated paths, one after the other.
+} _bb_db_deps_t;
+
+static _bb_db_t _bb_db_open(const char* path) {
+  const _bb_db_header_t* header;
+  size_t entries_end;
+  _bb_db_t db;
+
+  bb_assert(path != NULL);
+
+  db = bb_malloc(sizeof(*db));
+  db->path = bb_strdup(path);
+  db->map = NULL;
+  db->map_size = 0;
+  db->entries = NULL;
+  db->count = 0;
+  db->updates = bb_vector_default(_bb_db_update_t);
+
+#ifdef BB_PLATFORM_WINDOWS
+  BB_UNIMPLEMENTED_STUB();
+#else
+  struct stat info;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return db; // No database yet.
+  if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(*header)) {
+    close(fd);
+    goto corrupt;
+  }
+  db->map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (db->map == MAP_FAILED) {
+    db->map = NULL;
+    goto corrupt;
+  }
+  db->map_size = info.st_size;
+#endif
+
+  header = db->map;
+  if (memcmp(header->magic, _BB_DB_MAGIC, sizeof(header->magic)) ||
+      header->version != _BB_DB_VERSION)
+    goto corrupt;
+  entries_end = sizeof(*header) + header->count * sizeof(*db->entries);
+  if (header->count > db->map_size / sizeof(*db->entries) ||
+      entries_end > db->map_size)
+    goto corrupt;
+
+  db->entries = (const _bb_db_entry_t*)(header + 1);
+  db->count = header->count;
+  return db;
+
+corrupt:
+  bb_warn("Ignoring corrupt build database %s", path);
+  return db;
+}
+
+static const void* _bb_db_get(_bb_db_t db, uint64_t key, size_t* size) {
+  const _bb_db_entry_t* entry;
+  size_t low = 0, high;
+
+  bb_assert(db != NULL);
+
+  high = db->count;
+  while (low < high) {
+    entry = &db->entries[low + ((high - low) >> 1)];
+    if (entry->key < key)
+      low = entry - db->entries + 1;
+    else if (entry->key > key)
+      high = entry - db->entries;
+    else {
+      if (entry->offset > db->map_size ||
+          entry->size > db->map_size - entry->offset)
+        return NULL;
+      *size = entry->size;
+      return (const char*)db->map + entry->offset;
+    }
+  }
+  return NULL;
+}
+
+static void _bb_db_put(_bb_db_t db, uint64_t key,
+                       const void* blob, size_t size) {
+  _bb_db_update_t update;
+
+  bb_assert(db != NULL);
+  bb_assert(blob != NULL);
+
+  update.key = key;
+  update.order = bb_vector_length(db->updates);
+  update.size = size;
+  update.blob = bb_malloc(size);
+  memcpy(update.blob, blob, size);
+  bb_vector_push(db->updates, _bb_db_update_t, update);
+}
+
+static int _bb_db_update_compare(const void* a, const void* b) {
+  const _bb_db_update_t *ua = a, *ub = b;
+  if (ua->key != ub->key)
+    return ua->key < ub->key ? -1 : +1;
+  return ua->order < ub->order ? -1 : ua->order > ub->order ? +1 : 0;
+}
+
+static void _bb_file_makedirs_for(const char* path);
+
+static void _bb_db_write(_bb_db_t db) {
+  _bb_db_header_t header;
+  _bb_db_entry_t entry;
+  _bb_db_update_t *updates, *records;
+  const _bb_db_entry_t* old;
+  size_t n_updates, u = 0, e = 0, count = 0, offset, size;
+  char* data;
+
+  updates = db->updates;
+  n_updates = bb_vector_length(updates);
+  qsort(updates, n_updates, sizeof(*updates), _bb_db_update_compare);
+
+  // Merge the old entries with the updates, both sorted by key.
+  records = bb_malloc((db->count + n_updates) * sizeof(*records));
+  while (u < n_updates || e < db->count) {
+    // If a key was updated more than once, the last update wins.
+    if (u + 1 < n_updates && updates[u].key == updates[u + 1].key) {
+      ++u;
+      continue;
+    }
+    if (u == n_updates ||
+        (e < db->count && db->entries[e].key < updates[u].key)) {
+      old = &db->entries[e++];
+      if (old->offset > db->map_size ||
+          old->size > db->map_size - old->offset)
+        continue;
+      records[count].key = old->key;
+      records[count].size = old->size;
+      records[count++].blob = (char*)db->map + old->offset;
+      continue;
+    }
+    if (e < db->count && db->entries[e].key == updates[u].key)
+      ++e;
+    records[count++] = updates[u++];
+  }
+
+  // Blobs are laid out right after the index, 8-byte aligned.
+  offset = sizeof(header) + count * sizeof(entry);
+  size = offset;
+  for (size_t i = 0; i < count; ++i)
+    size += (records[i].size + 7) & ~(size_t)7;
+
+  // NOTE: The padding must be zeroed, so the file only depends on its
+  //       records.
+  data = bb_zalloc(size);
+  memcpy(header.magic, _BB_DB_MAGIC, sizeof(header.magic));
+  header.version = _BB_DB_VERSION;
+  header.count = count;
+  memcpy(data, &header, sizeof(header));
+  for (size_t i = 0; i < count; ++i) {
+    entry.key = records[i].key;
+    entry.offset = offset;
+    entry.size = records[i].size;
+    memcpy(data + sizeof(header) + i * sizeof(entry), &entry, sizeof(entry));
+    memcpy(data + offset, records[i].blob, records[i].size);
+    offset += (entry.size + 7) & ~(size_t)7;
+  }
+
+  _bb_file_makedirs_for(db->path);
+  bb_file_write_atomic(db->path, data, size, 0);
+
+  bb_free(&data);
+  bb_free(&records);
+}
+
+static void _bb_db_close(_bb_db_t* db) {
+  _bb_db_update_t* updates;
+
+  bb_assert(db != NULL);
+  bb_assert(*db != NULL);
+
+  updates = (*db)->updates;
+  if (bb_vector_length(updates) > 0)
+    _bb_db_write(*db);
+  for (size_t i = 0; i < bb_vector_length(updates); ++i)
+    bb_free(&updates[i].blob);
+  bb_vector_destroy(&(*db)->updates);
+#ifndef BB_PLATFORM_WINDOWS
+  if ((*db)->map != NULL)
+    munmap((*db)->map, (*db)->map_size);
+#endif
+  bb_free(&(*db)->path);
+  bb_free(db);
+}
+
+static inline uint64_t _bb_cmd_hash(bb_cmd_t cmd) {
+  uint64_t hash = ((uint64_t)cmd->argc << 32) | (uint32_t)cmd->envc;
+  for (int i = 0; i < cmd->argc; ++i)
+    hash = _bb_hash_cstr(cmd->argv[i], hash);
+  for (int i = 0; i < cmd->envc; ++i)
+    hash = _bb_hash_cstr(cmd->envp[i], hash);
+  return hash;
+}
+
+// Look up how a target was last built, in the records of the given kind.
+// Returns NULL if it's unknown.
+static const _bb_db_target_t* _bb_db_get_target(_bb_db_t db,
+                                                const char* path,
+                                                uint64_t kind) {
+  const _bb_db_target_t* target;
+  size_t size;
+
+  target = _bb_db_get(db, _bb_hash_cstr(path, kind), &size);
+  if (target == NULL || size < sizeof(*target) ||
+      target->count > (size - sizeof(*target)) / sizeof(*target->inputs))
+    return NULL;
+  return target;
+}
+
+static void _bb_touch_self(const char* self);
+
 static void _bb_rebuild_if_needed(char** argv) {
+  const _bb_db_target_t* target;
+  _bb_db_target_t* record;
+  bb_string_t error;
+  _bb_db_t db;
   bb_cmd_t cmd;
   time_t src, bin;
+  uint64_t src_size, src_hash;
 
   bb_assert(argv != NULL);
 
@@ -347,20 +2005,62 @@ static void _bb_rebuild_if_needed(char** argv) {
   if (src < bin)
     return;
 
-  bb_info("Rebuilding %s...", BB_SOURCE);
-
   cmd = bb_cmd_new();
   bb_cmd_append_args(cmd, BB_DEFAULT_CC);
   bb_cmd_append_args(cmd, BB_REBUILD_ARGS);
+
+  if (!_bb_file_get_info(BB_SOURCE, &src, &src_size) ||
+      !_bb_file_hash(BB_SOURCE, &src_hash))
+    bb_crit("Could not read %s", BB_SOURCE);
+
+  // Do not rebuild if the source was touched, but its contents and the
+  // rebuild command did not change.
+  // NOTE: The record is found by the source, since argv[0] depends on how
+  //       bb was run, e.g. ./bb or through PATH.
+  db = _bb_db_open(BB_DB_PATH);
+  target = _bb_db_get_target(db, BB_SOURCE, _BB_DB_KEY_REBUILD);
+  if (bin != 0 && target != NULL && target->count == 1 &&
+      target->cmd == _bb_cmd_hash(cmd) &&
+      target->inputs[0].hash == src_hash) {
+    _bb_db_close(&db);
+    bb_cmd_destroy(&cmd);
+    _bb_touch_self(argv[0]);
+    return;
+  }
+
+  bb_info("Rebuilding %s...", BB_SOURCE);
+
   if (bb_cmd_run(cmd) != 0)
     bb_crit("Could not rebuild %s", BB_SOURCE);
+
+  record = bb_malloc(sizeof(*record) + sizeof(*record->inputs));
+  record->cmd = _bb_cmd_hash(cmd);
+  record->count = 1;
+  record->inputs[0].path = _bb_hash_cstr(BB_SOURCE, 0);
+  record->inputs[0].mtime = src;
+  record->inputs[0].size = src_size;
+  record->inputs[0].hash = src_hash;
+  _bb_db_put(db, _bb_hash_cstr(BB_SOURCE, _BB_DB_KEY_REBUILD),
+             record, sizeof(*record) + sizeof(*record->inputs));
+  bb_free(&record);
+  _bb_db_close(&db);
   bb_cmd_destroy(&cmd);
 
+#ifdef BB_PLATFORM_WINDOWS
   cmd = bb_cmd_new();
   while (*argv != NULL)
     bb_cmd_append_args(cmd, *(argv++));
 
   exit(bb_cmd_run(cmd));
+#else
+  // Replace this process with the new executable, found like bb_cmd_run(..)
+  // would.
+  // NOTE: A child would be left waiting for by every restart of --watch.
+  fflush(NULL);
+  execvp(argv[0], argv);
+  error = _bb_strerror();
+  bb_crit("Could not run %s: %s", argv[0], error->cstr);
+#endif
 }
 
 // NOTE: This function updates the modification time of the bb executable.
@@ -389,96 +2089,307 @@ fail:
   bb_string_destroy(&error);
 }
 
-bb_string_t bb_string_new(size_t initial_capacity) {
-  bb_string_t str = bb_malloc(sizeof(*str));
-  str->capacity = initial_capacity < BB_STRING_MIN_CAPACITY ?
-                  BB_STRING_MIN_CAPACITY : initial_capacity;
+// Strings allocated in an arena are never freed: bb_string_destroy(..)
+// only forgets about them. If arena is NULL, the heap is used.
+bb_string_t bb_string_new_in(bb_arena_t arena, size_t initial_capacity) {
+  bb_string_t str;
+  size_t size;
+  if (initial_capacity < BB_STRING_MIN_CAPACITY)
+    initial_capacity = BB_STRING_MIN_CAPACITY;
+  size = sizeof(*str) + initial_capacity;
+  str = arena != NULL ? bb_arena_alloc(arena, size) : bb_malloc(size);
+  str->capacity = initial_capacity;
   str->length = 0;
-  str->cstr = bb_zalloc(str->capacity);
+  str->cstr = str->inline_cstr;
+  str->cstr[0] = '\0';
+  str->arena = arena;
   return str;
 }
 
-bb_string_t bb_string_from_cstr(const char* cstr) {
+bb_string_t bb_string_new(size_t initial_capacity) {
+  return bb_string_new_in(NULL, initial_capacity);
+}
+
+bb_string_t bb_string_from_cstr_in(bb_arena_t arena, const char* cstr) {
   bb_string_t str;
   bb_assert(cstr != NULL);
-  str = bb_string_new(strlen(cstr) + 1);
+  str = bb_string_new_in(arena, strlen(cstr) + 1);
   bb_string_concat(str, cstr);
   return str;
 }
 
-void bb_string_concat(bb_string_t dst, const char* src) {
-  size_t needed_capacity, src_length;
+bb_string_t bb_string_from_cstr(const char* cstr) {
+  return bb_string_from_cstr_in(NULL, cstr);
+}
 
-  bb_assert(dst != NULL);
-  bb_assert(src != NULL);
+// Make room for at least capacity bytes, including the NUL terminator.
+void bb_string_reserve(bb_string_t str, size_t capacity) {
+  bb_assert(str != NULL);
+  if (capacity <= str->capacity)
+    return;
+  if (str->arena != NULL) {
+    // NOTE: The old buffer stays in the arena until it is reset.
+    char* cstr = bb_arena_alloc(str->arena, capacity);
+    memcpy(cstr, str->cstr, str->length + 1);
+    str->cstr = cstr;
+  } else if (str->cstr == str->inline_cstr) {
+    str->cstr = bb_malloc(capacity);
+    memcpy(str->cstr, str->inline_cstr, str->length + 1);
+  } else
+    str->cstr = bb_realloc(str->cstr, capacity);
+  str->capacity = capacity;
+}
+
+// Make room for at least needed bytes, growing geometrically so that
+// building a string piece by piece takes linear time.
+static inline void _bb_string_grow(bb_string_t str, size_t needed) {
+  if (needed <= str->capacity)
+    return;
+  bb_string_reserve(str, needed > str->capacity << 1 ?
+                         needed : str->capacity << 1);
+}
 
-  src_length = strlen(src);
-  needed_capacity = dst->length + src_length + 1;
+void bb_string_shrink_to_fit(bb_string_t str) {
+  bb_assert(str != NULL);
+  // NOTE: The inline buffer and arena buffers cannot be shrunk.
+  if (str->cstr == str->inline_cstr || str->arena != NULL ||
+      str->length + 1 == str->capacity)
+    return;
+  str->capacity = str->length + 1;
+  str->cstr = bb_realloc(str->cstr, str->capacity);
+}
 
-  if (needed_capacity > dst->capacity) {
-    dst->capacity = needed_capacity;
-    dst->cstr = bb_realloc(dst->cstr, dst->capacity);
-  }
+// Append the first n characters of src, which need not be NUL-terminated.
+void bb_string_concat_n(bb_string_t dst, const char* src, size_t n) {
+  bb_assert(dst != NULL);
+  bb_assert(src != NULL || n == 0);
+  _bb_string_grow(dst, dst->length + n + 1);
+  memcpy(&dst->cstr[dst->length], src, n);
+  dst->length += n;
+  dst->cstr[dst->length] = '\0';
+}
 
-  strcpy(&dst->cstr[dst->length], src);
-  dst->length += src_length;
+void bb_string_concat(bb_string_t dst, const char* src) {
+  bb_assert(src != NULL);
+  bb_string_concat_n(dst, src, strlen(src));
 }
 
 void bb_string_append(bb_string_t dst, char c) {
   bb_assert(dst != NULL);
-  dst->cstr[dst->length] = c;
-  if (++dst->length + 1 > dst->capacity) {
-    dst->capacity = dst->length + BB_STRING_MIN_CAPACITY;
-    dst->cstr = bb_realloc(dst->cstr, dst->capacity);
-  }
+  _bb_string_grow(dst, dst->length + 2);
+  dst->cstr[dst->length++] = c;
   dst->cstr[dst->length] = '\0';
 }
 
+// Append formatted text, writing it straight into the spare capacity.
+void bb_string_appendf(bb_string_t dst, const char* fmt, ...) {
+  va_list ap;
+  size_t spare;
+  int n;
+
+  bb_assert(dst != NULL);
+  bb_assert(fmt != NULL);
+
+  spare = dst->capacity - dst->length;
+  va_start(ap, fmt);
+  n = vsnprintf(&dst->cstr[dst->length], spare, fmt, ap);
+  va_end(ap);
+  bb_assert(n >= 0);
+  if ((size_t)n >= spare) {
+    // It did not fit, now we know how much room it needs.
+    _bb_string_grow(dst, dst->length + n + 1);
+    va_start(ap, fmt);
+    vsnprintf(&dst->cstr[dst->length], n + 1, fmt, ap);
+    va_end(ap);
+  }
+  dst->length += n;
+}
+
 void bb_string_destroy(bb_string_t* str) {
   bb_assert(str != NULL);
   bb_assert(*str != NULL);
-  bb_free(&(*str)->cstr);
+  if ((*str)->arena != NULL) {
+    *str = NULL;
+    return;
+  }
+  if ((*str)->cstr != (*str)->inline_cstr)
+    bb_free(&(*str)->cstr);
   bb_free(str);
 }
 
-void bb_file_copy(const char* src_path, const char* dst_path) {
-  FILE *src, *dst;
-  bb_string_t error;
-  size_t bytes_read;
-  char *src_path2, *dst_path2;
-  char buffer[4096];
+// Destroy the string, but keep its contents, in a buffer that must be
+// freed with bb_free(..).
+static char* _bb_string_release(bb_string_t* str) {
+  char* cstr = (*str)->cstr;
+  if (cstr == (*str)->inline_cstr || (*str)->arena != NULL) {
+    cstr = bb_malloc((*str)->length + 1);
+    memcpy(cstr, (*str)->cstr, (*str)->length + 1);
+  }
+  if ((*str)->arena != NULL)
+    *str = NULL;
+  else
+    bb_free(str);
+  return cstr;
+}
 
-  bb_assert(src_path != NULL);
-  bb_assert(dst_path != NULL);
-  // Normalize paths.
-  src_path2 = bb_path(src_path);
-  dst_path2 = bb_path(dst_path);
+#ifndef BB_PLATFORM_WINDOWS
+// Copy the contents of src_fd into dst_fd through a userspace buffer.
+static int _bb_file_copy_buffered(int src_fd, int dst_fd) {
+  char* buffer = bb_malloc(BB_FILE_COPY_BUFFER_SIZE);
+  ssize_t n_read, n_written;
+  int ok = BB_FALSE;
+
+  for (;;) {
+    n_read = read(src_fd, buffer, BB_FILE_COPY_BUFFER_SIZE);
+    if (n_read < 0 && errno == EINTR)
+      continue;
+    if (n_read <= 0) {
+      ok = n_read == 0;
+      break;
+    }
+    for (ssize_t off = 0; off < n_read; off += n_written) {
+      n_written = write(dst_fd, buffer + off, n_read - off);
+      if (n_written < 0) {
+        if (errno != EINTR)
+          goto out;
+        n_written = 0;
+      }
+    }
+  }
 
-  src = fopen(src_path2, "r");
-  if (src == NULL)
-    goto fail;
+out:
+  bb_free(&buffer);
+  return ok;
+}
 
-  dst = fopen(dst_path2, "w");
-  if (dst == NULL)
-    goto fail;
+# ifdef BB_PLATFORM_LINUX
+// Copy size bytes from src_fd into dst_fd without going through userspace.
+// Returns BB_FALSE, without having written anything, if none of the
+// methods are supported for this pair of files.
+static int _bb_file_copy_kernel(int src_fd, int dst_fd, size_t size) {
+  size_t copied = 0;
+  ssize_t n;
+
+  // NOTE: Files like the ones in /proc report a size of zero, so we must
+  //       read them until the end.
+  if (size == 0)
+    return BB_FALSE;
 
-  while ((bytes_read = fread(buffer, 1, sizeof(buffer), src)) > 0) {
-    if (fwrite(buffer, 1, bytes_read, dst) < bytes_read)
-      goto fail;
-  }
+  // NOTE: On copy-on-write filesystems (btrfs, XFS, ...) a reflink shares
+  //       the extents of the source, so no data is copied at all.
+  if (ioctl(dst_fd, FICLONE, src_fd) == 0)
+    return BB_TRUE;
 
-  if (ferror(src))
-    goto fail;
+#   ifdef SYS_copy_file_range
+  // NOTE: We go through syscall(..) since the libc wrapper is only
+  //       declared with _GNU_SOURCE.
+  while (copied < size) {
+    n = syscall(SYS_copy_file_range, src_fd, NULL, dst_fd, NULL,
+                size - copied, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    copied += n;
+  }
+  if (copied == size)
+    return BB_TRUE;
+#   endif
 
-  fclose(dst);
-  fclose(src);
-  bb_free(&dst_path2);
-  bb_free(&src_path2);
-  return;
+  // NOTE: sendfile(..) continues from the current file offsets, which
+  //       copy_file_range(..) has already advanced.
+  while (copied < size) {
+    n = sendfile(dst_fd, src_fd, NULL, size - copied);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    copied += n;
+  }
+  if (copied == size)
+    return BB_TRUE;
+  if (copied > 0) {
+    // Finish with the buffered copy, from where we left off.
+    return _bb_file_copy_buffered(src_fd, dst_fd);
+  }
+  return BB_FALSE;
+}
+# endif
+#endif
+
+// Returns BB_FALSE, with errno set, on failure.
+static int _bb_file_copy(const char* src_path, const char* dst_path) {
+#ifdef BB_PLATFORM_WINDOWS
+  if (!CopyFileA(src_path, dst_path, FALSE))
+    return BB_FALSE;
+#else
+  struct stat st;
+  int src_fd, dst_fd = -1, ok, saved_errno;
+
+  src_fd = open(src_path, O_RDONLY | O_CLOEXEC);
+  if (src_fd < 0)
+    return BB_FALSE;
+  if (fstat(src_fd, &st) < 0)
+    goto fail;
+
+  dst_fd = open(dst_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                st.st_mode & 07777);
+  if (dst_fd < 0)
+    goto fail;
+  // NOTE: The mode passed to open(..) is masked by the umask, and is not
+  //       applied at all if the file already exists.
+  if (fchmod(dst_fd, st.st_mode & 07777) < 0)
+    goto fail;
+
+# ifdef BB_PLATFORM_LINUX
+  ok = _bb_file_copy_kernel(src_fd, dst_fd, st.st_size) ||
+       _bb_file_copy_buffered(src_fd, dst_fd);
+# else
+  ok = _bb_file_copy_buffered(src_fd, dst_fd);
+# endif
+  if (!ok)
+    goto fail;
+
+  ok = close(dst_fd) == 0;
+  dst_fd = -1;
+  if (!ok)
+    goto fail;
+  close(src_fd);
+#endif
+  _bb_stat_invalidate(dst_path, BB_FALSE);
+  return BB_TRUE;
 
+#ifndef BB_PLATFORM_WINDOWS
 fail:
-  error = _bb_strerror();
-  bb_crit("Could not copy file %s to %s: %s", src_path2, dst_path2, error->cstr);
+  saved_errno = errno;
+  if (dst_fd >= 0)
+    close(dst_fd);
+  close(src_fd);
+  errno = saved_errno;
+  return BB_FALSE;
+#endif
+}
+
+void bb_file_copy(const char* src_path, const char* dst_path) {
+  uint64_t start = bb_trace_begin();
+  bb_string_t error;
+  char *src_path2, *dst_path2;
+
+  bb_assert(src_path != NULL);
+  bb_assert(dst_path != NULL);
+  // Normalize paths.
+  src_path2 = bb_path(src_path);
+  dst_path2 = bb_path(dst_path);
+
+  if (!_bb_file_copy(src_path2, dst_path2)) {
+    error = _bb_strerror();
+    bb_crit("Could not copy file %s to %s: %s",
+            src_path2, dst_path2, error->cstr);
+  }
+
+  _bb_trace_file("Copy", start, dst_path2);
+  bb_free(&dst_path2);
+  bb_free(&src_path2);
 }
 
 void bb_file_write(const char* path, const void* buffer, size_t size) {
@@ -500,6 +2411,7 @@ void bb_file_write(const char* path, const void* buffer, size_t size) {
     goto fail;
 
   fclose(file);
+  _bb_stat_invalidate(path2, BB_FALSE);
   bb_free(&path2);
   return;
 
@@ -508,40 +2420,154 @@ fail:
   bb_crit("Could not write file %s: %s", path2, error->cstr);
 }
 
+#ifndef BB_PLATFORM_WINDOWS
+// Returns BB_TRUE if the file at path has exactly the given contents.
+static int _bb_file_equals(const char* path, const void* buffer, size_t size) {
+  bb_file_view_t view;
+  struct stat info;
+  int equal;
+
+  if (stat(path, &info) < 0 || (size_t)info.st_size != size)
+    return BB_FALSE;
+  view = _bb_file_view_open(path);
+  if (view == NULL)
+    return BB_FALSE;
+  equal = view->size == size && memcmp(view->data, buffer, size) == 0;
+  bb_file_view_close(&view);
+  return equal;
+}
+#endif
+
+// Write a file by writing a temporary file in the same directory and
+// renaming it over the destination, so that readers (and a crash) never
+// see a partially written file. With BB_FILE_WRITE_IF_CHANGED the file is
+// left untouched, and keeps its modification time, if it already has the
+// given contents. Returns BB_TRUE if the file was written.
+int bb_file_write_atomic(const char* path, const void* buffer, size_t size,
+                         int flags) {
+  uint64_t start = bb_trace_begin();
+  char* path2;
+  bb_string_t tmp_path, error;
+
+  bb_assert(path != NULL);
+  bb_assert(buffer != NULL || size == 0);
+
+  path2 = bb_path(path);
+  tmp_path = NULL;
+
+#ifdef BB_PLATFORM_WINDOWS
+  BB_UNIMPLEMENTED_STUB();
+#else
+  struct stat info;
+  char suffix[32];
+  ssize_t n;
+  int fd;
+
+  if ((flags & BB_FILE_WRITE_IF_CHANGED) &&
+      _bb_file_equals(path2, buffer, size)) {
+    bb_free(&path2);
+    return BB_FALSE;
+  }
+
+  // NOTE: The pid makes the name unique among concurrent writers. A
+  //       temporary file left behind by a crash is removed first, and
+  //       then the file is created exclusively.
+  snprintf(suffix, sizeof(suffix), ".tmp.%u", (unsigned int)getpid());
+  tmp_path = bb_string_from_cstr(path2);
+  bb_string_concat(tmp_path, suffix);
+  unlink(tmp_path->cstr);
+  fd = open(tmp_path->cstr, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd < 0)
+    goto fail;
+  // Keep the permissions of the file we are replacing.
+  if (stat(path2, &info) == 0)
+    fchmod(fd, info.st_mode & 07777);
+
+  for (size_t off = 0; off < size; off += n) {
+    n = write(fd, (const char*)buffer + off, size - off);
+    if (n < 0 && errno == EINTR)
+      n = 0;
+    else if (n < 0)
+      goto fail_close;
+  }
+# ifdef BB_PLATFORM_APPLE
+  if ((flags & BB_FILE_WRITE_SYNC) && fsync(fd) < 0)
+    goto fail_close;
+# else
+  if ((flags & BB_FILE_WRITE_SYNC) && fdatasync(fd) < 0)
+    goto fail_close;
+# endif
+  if (close(fd) < 0)
+    goto fail;
+  if (rename(tmp_path->cstr, path2) < 0)
+    goto fail;
+  _bb_stat_invalidate(path2, BB_FALSE);
+#endif
+
+  _bb_trace_file("Write", start, path2);
+  bb_string_destroy(&tmp_path);
+  bb_free(&path2);
+  return BB_TRUE;
+
+#ifndef BB_PLATFORM_WINDOWS
+fail_close:
+  close(fd);
+#endif
+fail:
+  error = _bb_strerror();
+  if (tmp_path != NULL)
+    unlink(tmp_path->cstr);
+  bb_crit("Could not write file %s: %s", path2, error->cstr);
+}
+
 void bb_file_free(void** buffer) {
   bb_free(buffer);
 }
 
-void* bb_file_read(const char* path) {
-  FILE* file;
-  void* buffer;
+// Read a whole file into a newly allocated buffer, which is NUL-terminated
+// for convenience. Its size is returned through size, if not NULL.
+void* bb_file_read_sized(const char* path, size_t* size) {
+  char* buffer;
   char* path2;
-  size_t size;
+  size_t file_size;
   bb_string_t error;
 
   bb_assert(path != NULL);
 
   path2 = bb_path(path);
 
-  file = fopen(path2, "r");
+#ifdef BB_PLATFORM_WINDOWS
+  FILE* file = fopen(path2, "rb");
   if (file == NULL)
     goto fail;
-
   if (fseek(file, 0, SEEK_END) < 0)
     goto fail;
-
-  size = ftell(file);
-  if ((long)size < 0)
+  file_size = ftell(file);
+  if ((long)file_size < 0)
     goto fail;
-
   rewind(file);
-
-  buffer = bb_zalloc(size);
-
-  if (fread(buffer, size, 1, file) != 1)
+  buffer = bb_malloc(file_size + 1);
+  if (file_size > 0 && fread(buffer, file_size, 1, file) != 1)
     goto fail;
-
   fclose(file);
+#else
+  struct stat info;
+  int fd = open(path2, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    goto fail;
+  if (fstat(fd, &info) < 0)
+    goto fail;
+  file_size = info.st_size;
+  // NOTE: The buffer is not zeroed, since it is overwritten right away.
+  buffer = bb_malloc(file_size + 1);
+  if (!_bb_fd_read_all(fd, buffer, file_size))
+    goto fail;
+  close(fd);
+#endif
+
+  buffer[file_size] = '\0';
+  if (size != NULL)
+    *size = file_size;
   bb_free(&path2);
   return buffer;
 
@@ -550,70 +2576,254 @@ fail:
   bb_crit("Could not read file %s: %s", path2, error->cstr);
 }
 
-static void _bb_file_delete(const char* path) {
-  bb_string_t error;
+void* bb_file_read(const char* path) {
+  return bb_file_read_sized(path, NULL);
+}
+
+#ifndef BB_PLATFORM_WINDOWS
+// A directory being deleted. Its descriptor stays open until all of its
+// subdirectories are gone, since they are opened and removed relative to
+// it.
+typedef struct _bb_delete_dir_s {
+  struct _bb_delete_dir_s* parent;
+  char* name;
+  int fd;
+  size_t pending; // Subdirectories not yet removed, plus 1 while scanning.
+} *_bb_delete_dir_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  _bb_delete_dir_t* queue; // Directories waiting for a worker.
+  size_t max_queued;       // 0 if not running in parallel.
+  size_t busy;             // Workers currently scanning a directory.
+  size_t removed;
+} *_bb_delete_t;
+
+static void _bb_file_delete_fail(const char* name) {
+  bb_string_t error = _bb_strerror();
+  bb_crit("Could not delete file %s: %s", name, error->cstr);
+}
+
+// Called when a directory has no entries left: remove it, and then its
+// parents that were only waiting for it.
+static void _bb_file_delete_release(_bb_delete_t del, _bb_delete_dir_t dir) {
+  _bb_delete_dir_t parent;
+  int parent_fd, empty;
+
+  while (dir != NULL) {
+    pthread_mutex_lock(&del->lock);
+    empty = --dir->pending == 0;
+    pthread_mutex_unlock(&del->lock);
+    if (!empty)
+      return;
+    parent = dir->parent;
+    parent_fd = parent != NULL ? parent->fd : AT_FDCWD;
+    close(dir->fd);
+    if (unlinkat(parent_fd, dir->name, AT_REMOVEDIR) < 0)
+      _bb_file_delete_fail(dir->name);
+    pthread_mutex_lock(&del->lock);
+    ++del->removed;
+    pthread_mutex_unlock(&del->lock);
+    bb_free(&dir->name);
+    bb_free(&dir);
+    dir = parent;
+  }
+}
+
+// Remove every entry of a directory, and then the directory itself.
+// Subdirectories are handed to other workers while there are idle ones,
+// and deleted right away otherwise.
+static void _bb_file_delete_dir(_bb_delete_t del, _bb_delete_dir_t dir) {
+  _bb_delete_dir_t subdir;
+  struct dirent* dir_ent;
+  struct stat info;
+  size_t removed = 0;
+  int parent_fd, fd, is_dir = BB_FALSE, queued;
+  DIR* dir_stream;
+
+  parent_fd = dir->parent != NULL ? dir->parent->fd : AT_FDCWD;
+  dir->fd = openat(parent_fd, dir->name,
+                   O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (dir->fd < 0)
+    _bb_file_delete_fail(dir->name);
+  // NOTE: closedir(..) closes the descriptor it was given, but we still
+  //       need ours for the subdirectories.
+  fd = dup(dir->fd);
+  if (fd < 0 || (dir_stream = fdopendir(fd)) == NULL)
+    _bb_file_delete_fail(dir->name);
+
+  errno = 0;
+  while ((dir_ent = readdir(dir_stream)) != NULL) {
+    if (!strcmp(dir_ent->d_name, ".") || !strcmp(dir_ent->d_name, ".."))
+      continue;
+    // NOTE: d_type saves a stat(..) per entry, but some filesystems do not
+    //       fill it in.
+    if (dir_ent->d_type != DT_UNKNOWN)
+      is_dir = dir_ent->d_type == DT_DIR;
+    else if (fstatat(dir->fd, dir_ent->d_name, &info,
+                     AT_SYMLINK_NOFOLLOW) < 0)
+      _bb_file_delete_fail(dir_ent->d_name);
+    else
+      is_dir = S_ISDIR(info.st_mode);
+
+    if (!is_dir) {
+      // NOTE: Symbolic links are removed, not followed.
+      if (unlinkat(dir->fd, dir_ent->d_name, 0) < 0)
+        _bb_file_delete_fail(dir_ent->d_name);
+      ++removed;
+      errno = 0;
+      continue;
+    }
+
+    subdir = bb_malloc(sizeof(*subdir));
+    subdir->parent = dir;
+    subdir->name = bb_strdup(dir_ent->d_name);
+    subdir->fd = -1;
+    subdir->pending = 1;
+    pthread_mutex_lock(&del->lock);
+    ++dir->pending;
+    queued = bb_vector_length(del->queue) < del->max_queued;
+    if (queued) {
+      bb_vector_push(del->queue, _bb_delete_dir_t, subdir);
+      pthread_cond_signal(&del->cond);
+    }
+    pthread_mutex_unlock(&del->lock);
+    if (!queued)
+      _bb_file_delete_dir(del, subdir);
+    errno = 0;
+  }
+  if (errno)
+    _bb_file_delete_fail(dir->name);
+  closedir(dir_stream);
+
+  pthread_mutex_lock(&del->lock);
+  del->removed += removed;
+  pthread_mutex_unlock(&del->lock);
+  _bb_file_delete_release(del, dir);
+}
+
+static void* _bb_file_delete_worker(void* arg) {
+  _bb_delete_t del = arg;
+  _bb_delete_dir_t dir;
+
+  pthread_mutex_lock(&del->lock);
+  for (;;) {
+    while (bb_vector_length(del->queue) == 0 && del->busy > 0)
+      pthread_cond_wait(&del->cond, &del->lock);
+    // Nothing is queued and nobody can queue anything else.
+    if (bb_vector_length(del->queue) == 0)
+      break;
+    bb_vector_pop(del->queue, &dir);
+    ++del->busy;
+    pthread_mutex_unlock(&del->lock);
+    _bb_file_delete_dir(del, dir);
+    pthread_mutex_lock(&del->lock);
+    --del->busy;
+  }
+  pthread_cond_broadcast(&del->cond);
+  pthread_mutex_unlock(&del->lock);
+  return NULL;
+}
+#endif
+
+// Delete a file or a directory tree using n_threads workers (1 for no
+// extra threads). Returns the number of entries removed.
+static size_t _bb_file_delete(const char* path, size_t n_threads) {
+  size_t removed;
 
   bb_assert(path != NULL);
+  bb_assert(n_threads > 0);
 
 #ifdef BB_PLATFORM_WINDOWS
   BB_UNIMPLEMENTED_STUB();
 #else
-  size_t ent_path_size;
   struct stat info;
-  struct dirent* dir_ent;
-  DIR* dir;
-  char* ent_path;
+  _bb_delete_dir_t root;
+  _bb_delete_t del;
+  pthread_t* threads;
 
-  if (stat(path, &info) < 0)
-    goto fail;
-  if (info.st_mode & S_IFDIR) {
-    ent_path_size = strlen(path) + 1 + 256 + 1;
-    ent_path = bb_zalloc(ent_path_size);
-
-    dir = opendir(path);
-    if (dir == NULL)
-      goto fail;
+  if (lstat(path, &info) < 0)
+    _bb_file_delete_fail(path);
+  if (!S_ISDIR(info.st_mode)) {
+    if (unlink(path) < 0)
+      _bb_file_delete_fail(path);
+    return 1;
+  }
 
-    errno = 0;
-    while ((dir_ent = readdir(dir)) != NULL) {
-      if (!strncmp(dir_ent->d_name, ".", 1) ||
-          !strncmp(dir_ent->d_name, "..", 2))
-        continue;
-      // Remove all files and subdirectories recursively.
-      snprintf(ent_path, ent_path_size, "%s/%s", path, dir_ent->d_name);
-      bb_file_delete(ent_path);
+  root = bb_malloc(sizeof(*root));
+  root->parent = NULL;
+  root->name = bb_strdup(path);
+  root->fd = -1;
+  root->pending = 1;
+
+  del = bb_malloc(sizeof(*del));
+  pthread_mutex_init(&del->lock, NULL);
+  pthread_cond_init(&del->cond, NULL);
+  del->queue = bb_vector_default(_bb_delete_dir_t);
+  del->busy = 0;
+  del->removed = 0;
+
+  if (n_threads == 1) {
+    del->max_queued = 0;
+    _bb_file_delete_dir(del, root);
+  } else {
+    // NOTE: Keeping the queue short bounds the number of open directories,
+    //       while still giving idle workers something to do.
+    del->max_queued = n_threads * 2;
+    bb_vector_push(del->queue, _bb_delete_dir_t, root);
+    threads = bb_malloc(n_threads * sizeof(*threads));
+    for (size_t i = 0; i < n_threads; ++i) {
+      if (pthread_create(&threads[i], NULL, _bb_file_delete_worker, del) != 0)
+        bb_crit("Could not create thread to delete %s", path);
     }
-    if (errno)
-      goto fail;
-    // Remove directory.
-    if (rmdir(path) < 0)
-      goto fail;
-
-    bb_free(&ent_path);
-  }
-  else if (info.st_mode & S_IFREG) {
-    // Remove file.
-    if (unlink(path) < 0)
-      goto fail;
+    for (size_t i = 0; i < n_threads; ++i)
+      pthread_join(threads[i], NULL);
+    bb_free(&threads);
   }
-  else
-    bb_crit("Unknown type for file %s", path);
+
+  removed = del->removed;
+  bb_vector_destroy(&del->queue);
+  pthread_cond_destroy(&del->cond);
+  pthread_mutex_destroy(&del->lock);
+  bb_free(&del);
 #endif
-  return;
+  return removed;
+}
 
-fail:
-  error = _bb_strerror();
-  bb_crit("Could not delete file %s: %s", path, error->cstr);
+// Delete a file or a directory tree. Returns the number of entries removed.
+size_t bb_file_delete(const char* path) {
+  uint64_t start = bb_trace_begin();
+  size_t removed;
+  char* path2;
+
+  bb_assert(path != NULL);
+  path2 = bb_path(path);
+
+  removed = _bb_file_delete(path2, 1);
+  _bb_stat_invalidate(path2, BB_TRUE);
+  _bb_trace_file("Delete", start, path2);
+  bb_free(&path2);
+  return removed;
 }
 
-void bb_file_delete(const char* path) {
+// Same as bb_file_delete(..), but directories are deleted by n_threads
+// workers in parallel (the number of CPUs if 0).
+size_t bb_file_delete_parallel(const char* path, size_t n_threads) {
+  uint64_t start = bb_trace_begin();
+  size_t removed;
   char* path2;
 
   bb_assert(path != NULL);
   path2 = bb_path(path);
 
-  _bb_file_delete(path2);
+  if (n_threads == 0)
+    n_threads = bb_cpu_count();
+  removed = _bb_file_delete(path2, n_threads);
+  _bb_stat_invalidate(path2, BB_TRUE);
+  _bb_trace_file("Delete", start, path2);
   bb_free(&path2);
+  return removed;
 }
 
 void bb_file_makedirs_from(const char* base, const char* path, int exist_ok) {
@@ -635,14 +2845,25 @@ void bb_file_makedirs_from(const char* base, const char* path, int exist_ok) {
 #ifdef BB_PLATFORM_WINDOWS
   BB_UNIMPLEMENTED_STUB();
 #else
-  size_t path_len, dname_len;
-  int rc, dir_fd;
+  size_t path_len, dname_len, key_len;
+  int dir_fd;
   char *start, *end;
   char *tmp_path, *tp;
+  bb_string_t key;
+  _bb_stat_t entry;
 
   path_len = strlen(path2);
   tmp_path = bb_zalloc(path_len + 1);
 
+  // The stat cache is keyed by the path relative to the working directory.
+  key = bb_string_default();
+  if (strcmp(base2, ".")) {
+    bb_string_concat(key, base2);
+    if (key->cstr[key->length - 1] != '/')
+      bb_string_append(key, '/');
+  }
+  key_len = key->length;
+
   dir_fd = open(base, O_DIRECTORY);
   if (dir_fd < 0) {
     goto fail;
@@ -674,28 +2895,43 @@ void bb_file_makedirs_from(const char* base, const char* path, int exist_ok) {
     if (dname_len == 1 && start[0] == '.')
       goto next;
 
-    // Append next directory name to temporary path buffer.
+    // Append next directory name to temporary path buffer. If the
+    // previous names were all '.', drop the separator.
+    if (tp == tmp_path && *start == '/') {
+      ++start;
+      --dname_len;
+    }
     strncpy(tp, start, dname_len);
     tp += dname_len;
     // Check if directory already exists.
-    errno = 0;
-    rc = faccessat(dir_fd, tmp_path, F_OK, 0);
-    if (rc < 0 && errno != ENOENT)
-      goto fail;
-    else if (rc == 0) {
+    key->length = key_len;
+    key->cstr[key_len] = '\0';
+    bb_string_concat(key, tmp_path);
+    entry = _bb_stat(key->cstr);
+    if (entry->exists) {
       if (!exist_ok) {
         errno = EEXIST;
         goto fail;
       }
     }
-    // Create the directory.
-    else if (mkdirat(dir_fd, tmp_path, S_IRWXU) < 0)
+    else if (entry->error != ENOENT) {
+      errno = entry->error;
       goto fail;
+    }
+    // Create the directory.
+    else {
+      _bb_stat_invalidate(key->cstr, BB_FALSE);
+      // NOTE: Someone else may have created it since it was cached.
+      if (mkdirat(dir_fd, tmp_path, S_IRWXU) < 0 &&
+          (errno != EEXIST || !exist_ok))
+        goto fail;
+    }
 
 next:
     start = end;
   } while (*start);
 
+  bb_string_destroy(&key);
   bb_free(&tmp_path);
   close(dir_fd);
 #endif
@@ -720,6 +2956,23 @@ void bb_file_makedirs(const char* dir_path, int exist_ok) {
   bb_file_makedirs_from(NULL, dir_path, exist_ok);
 }
 
+// Make the directories leading to the file at path, if there are any.
+static void _bb_file_makedirs_for(const char* path) {
+  const char* sep;
+  char* dir;
+
+  bb_assert(path != NULL);
+
+  sep = strrchr(path, '/');
+  if (sep == NULL || sep == path)
+    return;
+  dir = bb_malloc(sep - path + 1);
+  memcpy(dir, path, sep - path);
+  dir[sep - path] = '\0';
+  bb_file_makedirs(dir, BB_TRUE);
+  bb_free(&dir);
+}
+
 int bb_file_cmpmodtime(const char* a_path, const char* b_path) {
   time_t a_mtime, b_mtime;
 
@@ -729,205 +2982,2830 @@ int bb_file_cmpmodtime(const char* a_path, const char* b_path) {
   a_mtime = _bb_file_last_modification_time(a_path, BB_FALSE);
   b_mtime = _bb_file_last_modification_time(b_path, BB_FALSE);
 
-  return a_mtime < b_mtime ? -1 : a_mtime > b_mtime ? +1 : 0;
+  return a_mtime < b_mtime ? -1 : a_mtime > b_mtime ? +1 : 0;
+}
+
+#ifndef BB_PLATFORM_WINDOWS
+// Walk the directory opened as dir_fd, whose path (with a trailing slash,
+// or empty for the current directory) is in path. Entries are appended to
+// path in place, so no memory is allocated per entry.
+static void _bb_file_walk_at(int dir_fd, bb_string_t path,
+                             bb_file_walk_fn_t fn, void* data) {
+  bb_string_t error;
+  struct dirent* dir_ent;
+  struct stat info;
+  size_t length;
+  int fd, is_dir;
+  DIR* dir;
+
+  // NOTE: readdir(..) reads the entries in large batches with
+  //       getdents64(..) on Linux.
+  dir = fdopendir(dir_fd);
+  if (dir == NULL) {
+    close(dir_fd);
+    goto fail;
+  }
+
+  length = path->length;
+  errno = 0;
+  while ((dir_ent = readdir(dir)) != NULL) {
+    if (!strcmp(dir_ent->d_name, ".") || !strcmp(dir_ent->d_name, ".."))
+      continue;
+    bb_string_concat(path, dir_ent->d_name);
+
+    if (dir_ent->d_type != DT_UNKNOWN)
+      is_dir = dir_ent->d_type == DT_DIR;
+    else
+      is_dir = fstatat(dirfd(dir), dir_ent->d_name, &info,
+                       AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(info.st_mode);
+
+    if (fn(path->cstr, is_dir, data) && is_dir) {
+      fd = openat(dirfd(dir), dir_ent->d_name,
+                  O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (fd < 0)
+        goto fail;
+      bb_string_append(path, '/');
+      _bb_file_walk_at(fd, path, fn, data);
+    }
+
+    path->length = length;
+    path->cstr[length] = '\0';
+    errno = 0;
+  }
+  if (errno)
+    goto fail;
+  closedir(dir);
+  return;
+
+fail:
+  error = _bb_strerror();
+  bb_crit("Could not walk directory %s: %s", path->cstr, error->cstr);
+}
+#endif
+
+// Call fn for every file and directory under dir_path, recursively.
+// Symbolic links are reported, but not followed.
+void bb_file_walk(const char* dir_path, bb_file_walk_fn_t fn, void* data) {
+  uint64_t start = bb_trace_begin();
+  bb_string_t path, error;
+  char* dir_path2;
+
+  bb_assert(dir_path != NULL);
+  bb_assert(fn != NULL);
+
+  dir_path2 = bb_path(dir_path);
+#ifdef BB_PLATFORM_WINDOWS
+  BB_UNIMPLEMENTED_STUB();
+#else
+  int fd = open(dir_path2, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    error = _bb_strerror();
+    bb_crit("Could not walk directory %s: %s", dir_path2, error->cstr);
+  }
+  path = bb_string_from_cstr(dir_path2);
+  if (path->length > 0 && path->cstr[path->length - 1] != '/')
+    bb_string_append(path, '/');
+  _bb_file_walk_at(fd, path, fn, data);
+  bb_string_destroy(&path);
+#endif
+  _bb_trace_file("Walk", start, dir_path2);
+  bb_free(&dir_path2);
+}
+
+// Match a bracket expression, like [a-z] or [!0-9], against c. Returns the
+// pattern right after it, or NULL if c does not match.
+static const char* _bb_glob_match_class(const char* p, char c) {
+  int negate, matched = BB_FALSE;
+  char lo, hi;
+
+  negate = *p == '!' || *p == '^';
+  if (negate)
+    ++p;
+  // NOTE: A ']' right after the opening bracket is a literal.
+  do {
+    lo = hi = *p++;
+    if (*p == '-' && p[1] != ']' && p[1] != '\0') {
+      hi = p[1];
+      p += 2;
+    }
+    if (lo <= c && c <= hi)
+      matched = BB_TRUE;
+  } while (*p != ']' && *p != '\0');
+  if (*p == '\0')
+    return NULL;
+  return matched != negate ? p + 1 : NULL;
+}
+
+static int _bb_glob_match(const char* p, const char* s, const char* path) {
+  const char* next;
+  int component_start;
+
+  for (;;) {
+    component_start = s == path || s[-1] == '/';
+    switch (*p) {
+    case '\0':
+      return *s == '\0';
+
+    case '*':
+      if (p[1] == '*' && component_start && (p[2] == '/' || p[2] == '\0')) {
+        // "**" matches any number of components, even none.
+        p += p[2] == '/' ? 3 : 2;
+        for (;;) {
+          if (_bb_glob_match(p, s, path))
+            return BB_TRUE;
+          // NOTE: Hidden directories are not matched either.
+          if (*s == '.')
+            return BB_FALSE;
+          s = strchr(s, '/');
+          if (s == NULL)
+            return *p == '\0';
+          ++s;
+        }
+      }
+      // NOTE: Like in the shell, wildcards do not match hidden files.
+      if (component_start && *s == '.')
+        return BB_FALSE;
+      ++p;
+      for (;;) {
+        if (_bb_glob_match(p, s, path))
+          return BB_TRUE;
+        if (*s == '\0' || *s == '/')
+          return BB_FALSE;
+        ++s;
+      }
+
+    case '?':
+      if (*s == '\0' || *s == '/' || (component_start && *s == '.'))
+        return BB_FALSE;
+      ++p;
+      ++s;
+      break;
+
+    case '[':
+      if (*s == '\0' || *s == '/' || (component_start && *s == '.'))
+        return BB_FALSE;
+      next = _bb_glob_match_class(p + 1, *s);
+      if (next == NULL)
+        return BB_FALSE;
+      p = next;
+      ++s;
+      break;
+
+    case '\\':
+      if (p[1] != '\0')
+        ++p;
+      // fallthrough
+    default:
+      if (*p != *s)
+        return BB_FALSE;
+      ++p;
+      ++s;
+      break;
+    }
+  }
+}
+
+// Match a path against a glob pattern. Supports '*', '?', bracket
+// expressions, and '**' to match any number of directories.
+int bb_glob_match(const char* pattern, const char* path) {
+  bb_assert(pattern != NULL);
+  bb_assert(path != NULL);
+  return _bb_glob_match(pattern, path, path);
+}
+
+typedef struct {
+  const char* pattern;
+  size_t max_depth;  // SIZE_MAX if the pattern contains "**".
+  int walk_hidden;
+  bb_string_t data;
+  size_t* offsets;
+} *_bb_glob_t;
+
+static int _bb_file_glob_visit(const char* path, int is_dir, void* data) {
+  _bb_glob_t glob = data;
+  const char* name;
+  size_t depth = 0, length;
+
+  for (length = 0; path[length] != '\0'; ++length)
+    depth += path[length] == '/';
+  if (bb_glob_match(glob->pattern, path)) {
+    bb_vector_push(glob->offsets, size_t, glob->data->length);
+    // NOTE: The NUL terminator is kept, to separate the paths.
+    bb_string_concat_n(glob->data, path, length + 1);
+  }
+  if (!is_dir || depth + 1 >= glob->max_depth)
+    return BB_FALSE;
+  // NOTE: Wildcards never match hidden files, so there is no need to look
+  //       into hidden directories (like .git) unless the pattern names one.
+  name = strrchr(path, '/');
+  name = name != NULL ? name + 1 : path;
+  return *name != '.' || glob->walk_hidden;
+}
+
+static int _bb_file_list_compare(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Find the files and directories matching a glob pattern, like
+// "src/**/*.c". The paths are returned sorted, and stored in a single
+// buffer.
+bb_file_list_t bb_file_glob(const char* pattern) {
+  uint64_t start = bb_trace_begin();
+  bb_file_list_t list;
+  bb_string_t root;
+  const char *c, *root_end;
+  char* pattern2;
+  _bb_glob_t glob;
+  time_t mtime;
+  uint64_t size;
+
+  bb_assert(pattern != NULL);
+  pattern2 = bb_path(pattern);
+
+  // Walk from the longest leading directory without wildcards.
+  root_end = pattern2;
+  for (c = pattern2; *c != '\0' && strchr("*?[\\", *c) == NULL; ++c) {
+    if (*c == '/')
+      root_end = c + 1;
+  }
+
+  glob = bb_malloc(sizeof(*glob));
+  glob->pattern = pattern2;
+  glob->max_depth = 0;
+  for (c = pattern2; *c != '\0'; ++c)
+    glob->max_depth += *c == '/';
+  glob->max_depth += 1;
+  if (strstr(pattern2, "**") != NULL)
+    glob->max_depth = SIZE_MAX;
+  glob->walk_hidden = strstr(root_end, "/.") != NULL || *root_end == '.';
+  glob->data = bb_string_default();
+  glob->offsets = bb_vector_default(size_t);
+
+  if (strpbrk(pattern2, "*?[\\") == NULL) {
+    // Nothing to expand, just check whether the path exists.
+    if (_bb_file_get_info(pattern2, &mtime, &size)) {
+      bb_vector_push(glob->offsets, size_t, 0);
+      bb_string_concat(glob->data, pattern2);
+      bb_string_append(glob->data, '\0');
+    }
+  } else {
+    root = bb_string_default();
+    for (c = pattern2; c < root_end; ++c)
+      bb_string_append(root, *c);
+#ifdef BB_PLATFORM_WINDOWS
+    BB_UNIMPLEMENTED_STUB();
+#else
+    int fd = open(root->length > 0 ? root->cstr : ".",
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    // NOTE: A pattern matches nothing if its directory does not exist.
+    if (fd >= 0)
+      _bb_file_walk_at(fd, root, _bb_file_glob_visit, glob);
+#endif
+    bb_string_destroy(&root);
+  }
+
+  list = bb_malloc(sizeof(*list));
+  list->count = bb_vector_length(glob->offsets);
+  list->data = _bb_string_release(&glob->data);
+  list->paths = bb_vector_new(char*, list->count);
+  for (size_t i = 0; i < list->count; ++i)
+    bb_vector_push(list->paths, char*, list->data + glob->offsets[i]);
+  qsort(list->paths, list->count, sizeof(*list->paths),
+        _bb_file_list_compare);
+
+  bb_vector_destroy(&glob->offsets);
+  bb_free(&glob);
+  _bb_trace_file("Glob", start, pattern2);
+  bb_free(&pattern2);
+  return list;
+}
+
+void bb_file_list_destroy(bb_file_list_t* list) {
+  bb_assert(list != NULL);
+  bb_assert(*list != NULL);
+  bb_vector_destroy(&(*list)->paths);
+  bb_free(&(*list)->data);
+  bb_free(list);
+}
+
+char* bb_args_next(int* argc, char*** argv) {
+  bb_assert(argc != NULL);
+  bb_assert(argv != NULL);
+  bb_assert(*argv != NULL);
+  if (*argc <= 0)
+    return NULL;
+  return ((*argv)++)[(*argc)--];
+}
+
+// A command allocated in an arena keeps its arguments and environment
+// there too, so bb_cmd_destroy(..) has almost nothing to free. If arena is
+// NULL, the heap is used.
+bb_cmd_t bb_cmd_new_in(bb_arena_t arena) {
+  bb_cmd_t cmd;
+  cmd = arena != NULL ? bb_arena_alloc(arena, sizeof(*cmd))
+                      : bb_malloc(sizeof(*cmd));
+  cmd->argc = cmd->envc = 0;
+  cmd->argv = bb_vector_default_in(arena, char*);
+  cmd->envp = bb_vector_default_in(arena, char*);
+  cmd->capture = BB_FALSE;
+  cmd->memory = 0;
+  cmd->out = cmd->err = NULL;
+  cmd->arena = arena;
+  bb_vector_push(cmd->argv, char*, NULL);
+  bb_vector_push(cmd->envp, char*, NULL);
+  return cmd;
+}
+
+bb_cmd_t bb_cmd_new(void) {
+  return bb_cmd_new_in(NULL);
+}
+
+// Append a string to a NULL-terminated list, taking ownership of it.
+static void _bb_cmd_push_string(int* count, char*** list, char* s) {
+  (*list)[(*count)++] = s;
+  bb_vector_push(*list, char*, NULL);
+}
+
+static void _bb_cmd_append_strings(bb_arena_t arena, int* count,
+                                   char*** list, va_list ap) {
+  const char* s;
+  bb_assert(count != NULL);
+  bb_assert(list != NULL);
+  while ((s = va_arg(ap, const char*)) != NULL)
+    _bb_cmd_push_string(count, list, arena != NULL ? bb_arena_strdup(arena, s)
+                                                   : bb_strdup(s));
+}
+
+void _bb_cmd_append_args(bb_cmd_t cmd, ...) {
+  va_list ap;
+  bb_assert(cmd != NULL);
+  va_start(ap, cmd);
+  _bb_cmd_append_strings(cmd->arena, &cmd->argc, &cmd->argv, ap);
+  va_end(ap);
+}
+
+void _bb_cmd_append_envs(bb_cmd_t cmd, ...) {
+  va_list ap;
+  bb_assert(cmd != NULL);
+  va_start(ap, cmd);
+  _bb_cmd_append_strings(cmd->arena, &cmd->envc, &cmd->envp, ap);
+  va_end(ap);
+}
+
+static char* _bb_format(bb_arena_t arena, const char* fmt, va_list ap) {
+  va_list ap2;
+  char* buffer;
+  int length;
+
+  bb_assert(fmt != NULL);
+
+  va_copy(ap2, ap);
+  length = vsnprintf(NULL, 0, fmt, ap2);
+  va_end(ap2);
+  bb_assert(length >= 0);
+
+  buffer = arena != NULL ? bb_arena_alloc(arena, length + 1)
+                         : bb_malloc(length + 1);
+  vsnprintf(buffer, length + 1, fmt, ap);
+  return buffer;
+}
+
+void bb_cmd_append_argf(bb_cmd_t cmd, const char* fmt, ...) {
+  va_list ap;
+  bb_assert(cmd != NULL);
+  va_start(ap, fmt);
+  _bb_cmd_push_string(&cmd->argc, &cmd->argv, _bb_format(cmd->arena, fmt, ap));
+  va_end(ap);
+}
+
+void bb_cmd_append_envf(bb_cmd_t cmd, const char* fmt, ...) {
+  va_list ap;
+  bb_assert(cmd != NULL);
+  va_start(ap, fmt);
+  _bb_cmd_push_string(&cmd->envc, &cmd->envp, _bb_format(cmd->arena, fmt, ap));
+  va_end(ap);
+}
+
+// When set, the standard output and error of the command are captured into
+// cmd->out and cmd->err. Commands run by a job queue print their captured
+// output in one go, when they finish.
+void bb_cmd_set_capture(bb_cmd_t cmd, int capture) {
+  bb_assert(cmd != NULL);
+#ifdef BB_PLATFORM_WINDOWS
+  if (capture)
+    BB_UNIMPLEMENTED_STUB();
+#endif
+  cmd->capture = capture;
+}
+
+// Set how much memory the command is expected to use at its peak, so that
+// job queues with a memory budget can schedule it.
+void bb_cmd_set_memory(bb_cmd_t cmd, uint64_t bytes) {
+  bb_assert(cmd != NULL);
+  cmd->memory = bytes;
+}
+
+#ifndef BB_PLATFORM_WINDOWS
+// Read everything currently available from a capture pipe, and close it
+// once the other end is closed.
+static void _bb_capture_read(int* fd, bb_string_t buffer) {
+  ssize_t n;
+  while (*fd >= 0) {
+    _bb_string_grow(buffer, buffer->length + 4096);
+    n = read(*fd, buffer->cstr + buffer->length,
+             buffer->capacity - buffer->length - 1);
+    if (n > 0) {
+      buffer->length += n;
+      buffer->cstr[buffer->length] = '\0';
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+static inline void _bb_capture_close(int* fd) {
+  if (*fd < 0)
+    return;
+  close(*fd);
+  *fd = -1;
+}
+
+// How often to check for exited processes, where their exit cannot be
+// polled for, and for jobs that may be started later.
+# define _BB_JOBS_POLL_MS 10
+
+// Returns BB_TRUE if the process exited, without reaping it.
+static int _bb_proc_exited(bb_proc_t proc) {
+  siginfo_t info;
+
+  info.si_pid = 0;
+  return waitid(P_PID, proc, &info, WEXITED | WNOHANG | WNOWAIT) == 0 &&
+         info.si_pid != 0;
+}
+#endif
+
+// Open a descriptor that becomes readable when the process exits, so that
+// it can be polled for. Returns -1 where that's not supported, i.e. before
+// Linux 5.3 and on other platforms.
+static int _bb_pidfd_open(bb_proc_t proc) {
+#if defined(BB_PLATFORM_LINUX) && defined(SYS_pidfd_open)
+  return syscall(SYS_pidfd_open, proc, 0);
+#else
+  BB_UNUSED(proc);
+  return -1;
+#endif
+}
+
+
+// The most expensive commands run so far, for the summary printed after
+// a build. Only the command lines that make it into one of the lists are
+// formatted.
+typedef struct {
+  uint64_t cost;
+  bb_usage_t usage;
+  char* cmdline;
+} _bb_usage_entry_t;
+
+static struct {
+  size_t commands;
+  uint64_t cpu_ns;
+  uint64_t max_rss;
+  // Sorted from most to least expensive, at most BB_USAGE_MAX_TOP each.
+  _bb_usage_entry_t* by_cpu;
+  _bb_usage_entry_t* by_rss;
+} _bb_usage;
+
+// Length of the lists kept for the summary.
+#define _BB_USAGE_MAX_TOP 64
+
+#ifndef BB_PLATFORM_WINDOWS
+static void _bb_usage_from_rusage(const struct rusage* ru, bb_usage_t* usage) {
+  usage->user_ns = (uint64_t)ru->ru_utime.tv_sec * 1000000000ULL +
+                   (uint64_t)ru->ru_utime.tv_usec * 1000;
+  usage->sys_ns = (uint64_t)ru->ru_stime.tv_sec * 1000000000ULL +
+                  (uint64_t)ru->ru_stime.tv_usec * 1000;
+# ifdef BB_PLATFORM_APPLE
+  usage->max_rss = ru->ru_maxrss;
+# else
+  usage->max_rss = (uint64_t)ru->ru_maxrss * 1024; // In KiB on Linux.
+# endif
+}
+#endif
+
+static void _bb_usage_insert(_bb_usage_entry_t** list, uint64_t cost,
+                             bb_cmd_t cmd, const bb_usage_t* usage) {
+  _bb_usage_entry_t entry;
+  bb_string_t cmdline;
+  size_t length, i;
+
+  if (*list == NULL)
+    *list = bb_vector_new(_bb_usage_entry_t, _BB_USAGE_MAX_TOP);
+  length = bb_vector_length(*list);
+  if (length == _BB_USAGE_MAX_TOP && (*list)[length - 1].cost >= cost)
+    return;
+  for (i = 0; i < bb_vector_length(*list) && (*list)[i].cost >= cost; ++i)
+    ;
+  if (length == _BB_USAGE_MAX_TOP) {
+    bb_vector_pop(*list, &entry);
+    bb_free(&entry.cmdline);
+  }
+  cmdline = bb_cmd_to_string(cmd);
+  entry.cost = cost;
+  entry.usage = *usage;
+  entry.cmdline = bb_strdup(cmdline->cstr);
+  bb_string_destroy(&cmdline);
+  bb_vector_insert(*list, _bb_usage_entry_t, i, entry);
+}
+
+static void _bb_usage_record(bb_cmd_t cmd, const bb_usage_t* usage) {
+  uint64_t cpu_ns = usage->user_ns + usage->sys_ns;
+
+  ++_bb_usage.commands;
+  _bb_usage.cpu_ns += cpu_ns;
+  if (usage->max_rss > _bb_usage.max_rss)
+    _bb_usage.max_rss = usage->max_rss;
+  _bb_usage_insert(&_bb_usage.by_cpu, cpu_ns, cmd, usage);
+  _bb_usage_insert(&_bb_usage.by_rss, usage->max_rss, cmd, usage);
+}
+
+static void _bb_usage_print_list(const char* title,
+                                 _bb_usage_entry_t* list, size_t top) {
+  _bb_usage_entry_t* entry;
+
+  bb_info("%s:", title);
+  for (size_t i = 0; i < top && i < bb_vector_length(list); ++i) {
+    entry = &list[i];
+    bb_info("  %8.3f s cpu %8.3f s wall %8.1f MiB  %s",
+            (entry->usage.user_ns + entry->usage.sys_ns) / 1e9,
+            entry->usage.wall_ns / 1e9, entry->usage.max_rss / 1048576.0,
+            entry->cmdline);
+  }
+}
+
+// Print the top (at most 64) commands that used the most CPU time, and
+// the most memory, since the last reset.
+void bb_usage_summary_print(size_t top) {
+  if (_bb_usage.commands == 0 || top == 0)
+    return;
+  if (top > _BB_USAGE_MAX_TOP)
+    top = _BB_USAGE_MAX_TOP;
+  bb_info("Ran %zu commands, using %.3f s of CPU time and up to %.1f MiB",
+          _bb_usage.commands, _bb_usage.cpu_ns / 1e9,
+          _bb_usage.max_rss / 1048576.0);
+  _bb_usage_print_list("Most CPU time", _bb_usage.by_cpu, top);
+  _bb_usage_print_list("Most memory", _bb_usage.by_rss, top);
+}
+
+void bb_usage_summary_reset(void) {
+  if (_bb_usage.by_cpu != NULL) {
+    for (size_t i = 0; i < bb_vector_length(_bb_usage.by_cpu); ++i)
+      bb_free(&_bb_usage.by_cpu[i].cmdline);
+    for (size_t i = 0; i < bb_vector_length(_bb_usage.by_rss); ++i)
+      bb_free(&_bb_usage.by_rss[i].cmdline);
+    bb_vector_destroy(&_bb_usage.by_cpu);
+    bb_vector_destroy(&_bb_usage.by_rss);
+  }
+  _bb_usage.commands = 0;
+  _bb_usage.cpu_ns = 0;
+  _bb_usage.max_rss = 0;
+}
+
+int bb_cmd_wait(bb_proc_t proc) {
+  return bb_cmd_wait_usage(proc, NULL);
+}
+
+// Same as bb_cmd_wait(..), but also returns the resources used by the
+// process, if usage is not NULL. Its wall time is not known here, so it's
+// left at 0.
+int bb_cmd_wait_usage(bb_proc_t proc, bb_usage_t* usage) {
+  bb_string_t error;
+  if (usage != NULL)
+    memset(usage, 0, sizeof(*usage));
+#ifdef BB_PLATFORM_WINDOWS
+  DWORD exit_code;
+  _bb_stat_invalidate_cwd();
+  if (WaitForSingleObject(proc, INFINITE) == WAIT_FAILED ||
+      !GetExitCodeProcess(proc, &exit_code))
+    goto fail;
+  return exit_code;
+#else
+  struct rusage ru;
+  int wstatus;
+  // NOTE: We do not know which files the command touched.
+  _bb_stat_invalidate_cwd();
+  while (wait4(proc, &wstatus, 0, &ru) < 0) {
+    if (errno != EINTR)
+      goto fail;
+  }
+  if (usage != NULL)
+    _bb_usage_from_rusage(&ru, usage);
+  if (!WIFEXITED(wstatus))
+    goto fail;
+  return WEXITSTATUS(wstatus);
+#endif
+fail:
+  error = _bb_strerror();
+  bb_warn("Could not wait for child process %u: %s",
+          _bb_proc_id(proc), error->cstr);
+  bb_info("Assuming child process failed");
+  bb_string_destroy(&error);
+  return EXIT_FAILURE;
+}
+
+// Append a string to a command line, quoting it if needed.
+static void _bb_string_concat_arg(bb_string_t dst, const char* arg) {
+  size_t backslashes = 0;
+
+  if (dst->length > 0)
+    bb_string_append(dst, ' ');
+  if (*arg != '\0' && strpbrk(arg, " \t\n\"") == NULL) {
+    bb_string_concat(dst, arg);
+    return;
+  }
+
+  // NOTE: This follows the quoting rules of CommandLineToArgvW(..), since
+  //       this string is also used as the command line on Windows.
+  bb_string_append(dst, '"');
+  for (; *arg; ++arg) {
+    if (*arg == '\\') {
+      ++backslashes;
+      continue;
+    }
+    // Backslashes are only special when they precede a quote.
+    if (*arg == '"')
+      backslashes = backslashes * 2 + 1;
+    for (; backslashes > 0; --backslashes)
+      bb_string_append(dst, '\\');
+    bb_string_append(dst, *arg);
+  }
+  for (backslashes *= 2; backslashes > 0; --backslashes)
+    bb_string_append(dst, '\\');
+  bb_string_append(dst, '"');
+}
+
+bb_string_t bb_cmd_to_string(bb_cmd_t cmd) {
+  bb_string_t str;
+  bb_assert(cmd != NULL);
+  str = bb_string_default();
+  for (int i = 0; i < cmd->argc; ++i)
+    _bb_string_concat_arg(str, cmd->argv[i]);
+  return str;
+}
+
+#ifndef BB_PLATFORM_WINDOWS
+// Build the environment of a child process, which is the environment of
+// this process with the variables set by the command added or replaced.
+static char** _bb_cmd_make_envp(bb_cmd_t cmd) {
+  size_t n_environ = 0, count = 0, name_length;
+  char** envp;
+  int overridden;
+
+  if (cmd->envc == 0)
+    return environ;
+
+  while (environ[n_environ] != NULL)
+    ++n_environ;
+  envp = bb_malloc((n_environ + cmd->envc + 1) * sizeof(*envp));
+  for (size_t i = 0; i < n_environ; ++i) {
+    name_length = strcspn(environ[i], "=");
+    overridden = BB_FALSE;
+    for (int e = 0; e < cmd->envc && !overridden; ++e)
+      overridden = !strncmp(cmd->envp[e], environ[i], name_length + 1);
+    if (!overridden)
+      envp[count++] = environ[i];
+  }
+  for (int e = 0; e < cmd->envc; ++e)
+    envp[count++] = cmd->envp[e];
+  envp[count] = NULL;
+  return envp;
+}
+#endif
+
+// Spawn the command. If the command's output is captured, the read ends
+// of the pipes are returned through out_fd and err_fd.
+static bb_proc_t _bb_cmd_execute(bb_cmd_t cmd, int* out_fd, int* err_fd) {
+  bb_proc_t proc;
+  bb_string_t cmdline, error;
+  uint64_t spawn_start;
+
+  bb_assert(cmd != NULL);
+  bb_assert(cmd->argc > 0);
+  bb_assert(!cmd->capture || (out_fd != NULL && err_fd != NULL));
+
+  if (cmd->capture) {
+    if (cmd->out == NULL) {
+      cmd->out = bb_string_default();
+      cmd->err = bb_string_default();
+    }
+    cmd->out->length = cmd->err->length = 0;
+    cmd->out->cstr[0] = cmd->err->cstr[0] = '\0';
+  }
+
+  cmdline = bb_cmd_to_string(cmd);
+  bb_info("Executing: %s", cmdline->cstr);
+  if (cmd->envc > 0) {
+    bb_string_t cmdenv = bb_string_default();
+    for (int i = 0; i < cmd->envc; ++i)
+      _bb_string_concat_arg(cmdenv, cmd->envp[i]);
+    bb_info("- with environment: %s", cmdenv->cstr);
+    bb_string_destroy(&cmdenv);
+  }
+
+  spawn_start = _bb_time_ns();
+#ifdef BB_PLATFORM_WINDOWS
+  PROCESS_INFORMATION proc_info = {0};
+  STARTUPINFOA startup_info = {0};
+  bb_string_t env_block = NULL;
+  LPCH parent_env;
+  startup_info.cb = sizeof(startup_info);
+  if (cmd->envc > 0) {
+    // The environment block is a sequence of NUL-terminated strings,
+    // terminated by an empty string.
+    env_block = bb_string_default();
+    parent_env = GetEnvironmentStringsA();
+    for (LPCH e = parent_env; *e; e += strlen(e) + 1) {
+      bb_string_concat(env_block, e);
+      bb_string_append(env_block, '\0');
+    }
+    FreeEnvironmentStringsA(parent_env);
+    for (int i = 0; i < cmd->envc; ++i) {
+      bb_string_concat(env_block, cmd->envp[i]);
+      bb_string_append(env_block, '\0');
+    }
+    bb_string_append(env_block, '\0');
+  }
+  if (!CreateProcessA(NULL, cmdline->cstr, NULL, NULL,
+                      FALSE, NORMAL_PRIORITY_CLASS,
+                      env_block != NULL ? env_block->cstr : NULL,
+                      NULL, &startup_info, &proc_info))
+    goto fail;
+  proc = proc_info.hProcess;
+  if (env_block != NULL)
+    bb_string_destroy(&env_block);
+#else
+  char** envp = _bb_cmd_make_envp(cmd);
+  int out_pipe[2], err_pipe[2];
+  if (cmd->capture) {
+    if (pipe(out_pipe) < 0 || pipe(err_pipe) < 0)
+      goto fail;
+    // NOTE: The pipes must not leak into other children. The ends that
+    //       are duplicated onto stdout and stderr lose this flag.
+    for (int i = 0; i < 2; ++i) {
+      fcntl(out_pipe[i], F_SETFD, FD_CLOEXEC);
+      fcntl(err_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+  }
+# ifdef BB_USE_FORK
+  proc = fork();
+  if (proc < 0)
+    goto fail;
+  if (proc == 0) {
+    if (cmd->capture) {
+      dup2(out_pipe[1], STDOUT_FILENO);
+      dup2(err_pipe[1], STDERR_FILENO);
+    }
+    environ = envp;
+    execvp(cmd->argv[0], cmd->argv);
+    // NOTE: exit(..) would run the atexit handlers of the parent, e.g.
+    //       writing the trace or giving back jobserver tokens.
+    bb_error("Could not execute command: %s", cmdline->cstr);
+    _exit(127);
+  }
+# else
+  // NOTE: posix_spawnp(..) does not copy the address space of this process,
+  //       so spawning is cheap even when the heap is large.
+  posix_spawn_file_actions_t actions;
+  int rc;
+  posix_spawn_file_actions_init(&actions);
+  if (cmd->capture) {
+    posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+  }
+  rc = posix_spawnp(&proc, cmd->argv[0], &actions, NULL, cmd->argv, envp);
+  posix_spawn_file_actions_destroy(&actions);
+  if (rc != 0) {
+    // NOTE: A command that cannot be run (e.g. a missing compiler) fails
+    //       like it does with fork(..) and execvp(..), or in a shell, with
+    //       status 127, so that callers handle it like any other failure.
+    //       A child that exits right away stands in for it.
+    errno = rc;
+    error = _bb_strerror();
+    bb_error("Could not execute command: %s: %s", cmdline->cstr,
+             error->cstr);
+    bb_string_destroy(&error);
+    proc = fork();
+    if (proc < 0)
+      goto fail;
+    if (proc == 0)
+      _exit(127);
+  }
+# endif
+  if (envp != environ)
+    bb_free(&envp);
+  if (cmd->capture) {
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    fcntl(out_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(err_pipe[0], F_SETFL, O_NONBLOCK);
+    *out_fd = out_pipe[0];
+    *err_fd = err_pipe[0];
+  }
+#endif
+
+  bb_info("- as process: %u (spawned in %.3f ms)", _bb_proc_id(proc),
+          (_bb_time_ns() - spawn_start) / 1e6);
+
+  bb_string_destroy(&cmdline);
+
+  return proc;
+
+fail:
+  error = _bb_strerror();
+  bb_crit("Could not run command: %s: %s",
+          cmdline->cstr, error->cstr);
+}
+
+bb_proc_t bb_cmd_run_async(bb_cmd_t cmd) {
+  bb_assert(cmd != NULL);
+  // NOTE: Use a job queue to run commands with captured output
+  //       asynchronously.
+  bb_assert(!cmd->capture);
+  return _bb_cmd_execute(cmd, NULL, NULL);
+}
+
+// Record the run of a command, on the thread of its job slot.
+static void _bb_trace_cmd(bb_cmd_t cmd, size_t tid, bb_proc_t proc,
+                          uint64_t start, int exit_status,
+                          const bb_usage_t* usage) {
+  bb_string_t cmdline;
+  char args[160];
+
+  if (_bb_trace.path == NULL)
+    return;
+  cmdline = bb_cmd_to_string(cmd);
+  snprintf(args, sizeof(args), "\"pid\":%u,\"exit_status\":%d,"
+           "\"user_ms\":%.3f,\"sys_ms\":%.3f,\"max_rss_kib\":%llu",
+           _bb_proc_id(proc), exit_status, usage->user_ns / 1e6,
+           usage->sys_ns / 1e6, (unsigned long long)(usage->max_rss >> 10));
+  _bb_trace_span("command", cmdline->cstr, tid, start, _bb_time_ns(), args);
+  bb_string_destroy(&cmdline);
+}
+
+int bb_cmd_run(bb_cmd_t cmd) {
+  uint64_t start = _bb_time_ns();
+  bb_usage_t usage;
+  bb_proc_t proc;
+  int exit_status;
+  bb_assert(cmd != NULL);
+#ifndef BB_PLATFORM_WINDOWS
+  int out_fd = -1, err_fd = -1, pid_fd = -1;
+  struct pollfd fds[3];
+  proc = _bb_cmd_execute(cmd, &out_fd, &err_fd);
+  if (cmd->capture)
+    pid_fd = _bb_pidfd_open(proc);
+  while (out_fd >= 0 || err_fd >= 0) {
+    fds[0].fd = out_fd;
+    fds[1].fd = err_fd;
+    fds[2].fd = pid_fd;
+    fds[0].events = fds[1].events = fds[2].events = POLLIN;
+    // NOTE: Negative descriptors are ignored by poll(..).
+    if (poll(fds, 3, pid_fd >= 0 ? -1 : _BB_JOBS_POLL_MS) < 0 &&
+        errno != EINTR)
+      break;
+    _bb_capture_read(&out_fd, cmd->out);
+    _bb_capture_read(&err_fd, cmd->err);
+    // NOTE: A grandchild may hold the pipes open long after the command
+    //       exits, so we stop at its exit, with what it wrote until then.
+    if (_bb_proc_exited(proc)) {
+      _bb_capture_read(&out_fd, cmd->out);
+      _bb_capture_read(&err_fd, cmd->err);
+      break;
+    }
+  }
+  _bb_capture_close(&out_fd);
+  _bb_capture_close(&err_fd);
+  _bb_capture_close(&pid_fd);
+#else
+  proc = _bb_cmd_execute(cmd, NULL, NULL);
+#endif
+  exit_status = bb_cmd_wait_usage(proc, &usage);
+  usage.wall_ns = _bb_time_ns() - start;
+  _bb_usage_record(cmd, &usage);
+  _bb_trace_cmd(cmd, 0, proc, start, exit_status, &usage);
+  return exit_status;
+}
+
+static void _bb_cmd_free_strings(int count, char*** list) {
+  for (int i = 0; i < count; ++i)
+    bb_free(&(*list)[i]);
+  bb_vector_destroy(list);
+}
+
+void bb_cmd_destroy(bb_cmd_t* cmd) {
+  bb_assert(cmd != NULL);
+  bb_assert(*cmd != NULL);
+  // NOTE: The captured output is always on the heap.
+  if ((*cmd)->out != NULL) {
+    bb_string_destroy(&(*cmd)->out);
+    bb_string_destroy(&(*cmd)->err);
+  }
+  if ((*cmd)->arena != NULL) {
+    *cmd = NULL;
+    return;
+  }
+  _bb_cmd_free_strings((*cmd)->argc, &(*cmd)->argv);
+  _bb_cmd_free_strings((*cmd)->envc, &(*cmd)->envp);
+  bb_free(cmd);
+}
+
+// The clone is always allocated on the heap.
+bb_cmd_t bb_cmd_clone(bb_cmd_t cmd) {
+  bb_cmd_t clone;
+  bb_assert(cmd != NULL);
+  clone = bb_cmd_new();
+  for (int i = 0; i < cmd->argc; ++i)
+    _bb_cmd_push_string(&clone->argc, &clone->argv, bb_strdup(cmd->argv[i]));
+  for (int i = 0; i < cmd->envc; ++i)
+    _bb_cmd_push_string(&clone->envc, &clone->envp, bb_strdup(cmd->envp[i]));
+  clone->capture = cmd->capture;
+  clone->memory = cmd->memory;
+  return clone;
+}
+
+size_t bb_cpu_count(void) {
+#ifdef BB_PLATFORM_WINDOWS
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (size_t)count : 1;
+#endif
+}
+
+// Settings given to job queues when they are created.
+static struct {
+  size_t max_jobs;   // 0 for one per CPU.
+  uint64_t memory_budget;
+  int watch_pressure;
+} _bb_jobs_defaults;
+
+bb_jobs_t bb_jobs_new(size_t max_jobs) {
+  bb_jobs_t jobs = bb_malloc(sizeof(*jobs));
+  if (max_jobs == 0)
+    max_jobs = _bb_jobs_defaults.max_jobs;
+  jobs->max_jobs = max_jobs > 0 ? max_jobs : bb_cpu_count();
+  jobs->memory_budget = _bb_jobs_defaults.memory_budget;
+  jobs->memory_used = 0;
+  jobs->watch_pressure = _bb_jobs_defaults.watch_pressure;
+  jobs->throttled = BB_FALSE;
+  jobs->running = 0;
+  jobs->next_pending = 0;
+  jobs->next_done = 0;
+  jobs->jobs = bb_vector_default(bb_job_t);
+  jobs->done = bb_vector_default(bb_job_t);
+  jobs->slots = bb_zalloc(jobs->max_jobs * sizeof(*jobs->slots));
+  return jobs;
+}
+
+// Limit the jobs running at once by the memory they are expected to use
+// (see bb_cmd_set_memory(..)), to at most budget bytes, 0 for no limit.
+// Jobs of unknown size do not count towards it, but are not started while
+// it's used up. With watch_pressure, on Linux, jobs are also held back
+// while the system is short on memory. A job is always started if nothing
+// else is running.
+void bb_jobs_set_memory_limit(bb_jobs_t jobs, uint64_t budget,
+                              int watch_pressure) {
+  bb_assert(jobs != NULL);
+  jobs->memory_budget = budget;
+  jobs->watch_pressure = watch_pressure;
+}
+
+// How many jobs to look past one that does not fit in the memory budget,
+// for smaller ones that do.
+#define _BB_JOBS_LOOKAHEAD 64
+
+// How often to read the memory state of the system, at most.
+#define _BB_MEMORY_POLL_MS 100
+
+#ifdef BB_PLATFORM_LINUX
+// Returns the value of a field of /proc/meminfo, in bytes, or UINT64_MAX
+// if it cannot be read.
+static uint64_t _bb_meminfo_get(const char* field) {
+  char buffer[4096], *line;
+  size_t length = strlen(field);
+  unsigned long long kib;
+  ssize_t n;
+  int fd;
+
+  fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return UINT64_MAX;
+  n = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (n <= 0)
+    return UINT64_MAX;
+  buffer[n] = '\0';
+  for (line = buffer; line != NULL; line = strchr(line, '\n')) {
+    line += *line == '\n';
+    if (!strncmp(line, field, length) && line[length] == ':' &&
+        sscanf(line + length + 1, "%llu", &kib) == 1)
+      return (uint64_t)kib << 10;
+  }
+  return UINT64_MAX;
+}
+
+// Returns the share of the last 10 seconds some tasks were stalled on
+// memory, in percent, or 0 if the kernel does not report it.
+static double _bb_memory_pressure(void) {
+  char buffer[256];
+  double avg10 = 0;
+  ssize_t n;
+  int fd;
+
+  fd = open("/proc/pressure/memory", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  n = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buffer[n] = '\0';
+  if (sscanf(buffer, "some avg10=%lf", &avg10) != 1)
+    return 0;
+  return avg10;
+}
+#endif
+
+// Returns BB_TRUE if starting a job that needs this much memory could make
+// the system swap, or run out of memory.
+static int _bb_memory_is_short(uint64_t needed) {
+#ifdef BB_PLATFORM_LINUX
+  static uint64_t last_read, available;
+  static double pressure;
+  uint64_t now = _bb_time_ns();
+
+  if (last_read == 0 || now - last_read >= _BB_MEMORY_POLL_MS * 1000000ULL) {
+    last_read = now;
+    available = _bb_meminfo_get("MemAvailable");
+    pressure = _bb_memory_pressure();
+  }
+  return available < needed + BB_MEMORY_RESERVE ||
+         pressure > BB_MEMORY_PRESSURE_MAX;
+#else
+  BB_UNUSED(needed);
+  return BB_FALSE;
+#endif
+}
+
+// Returns the next pending job that can be started, or NULL if they must
+// wait for memory to be freed.
+static bb_job_t _bb_jobs_next(bb_jobs_t jobs) {
+  size_t n_jobs = bb_vector_length(jobs->jobs), end;
+  uint64_t memory;
+  bb_job_t job;
+
+  // Skip the jobs that were started out of order.
+  while (jobs->next_pending < n_jobs &&
+         jobs->jobs[jobs->next_pending]->state != BB_JOB_PENDING)
+    ++jobs->next_pending;
+  if (jobs->next_pending == n_jobs)
+    return NULL;
+  job = jobs->jobs[jobs->next_pending];
+  if (jobs->running == 0)
+    return job;
+
+  if (jobs->watch_pressure && _bb_memory_is_short(job->cmd->memory)) {
+    jobs->throttled = BB_TRUE;
+    return NULL;
+  }
+  if (jobs->memory_budget == 0)
+    return job;
+  end = jobs->next_pending + _BB_JOBS_LOOKAHEAD;
+  for (size_t i = jobs->next_pending; i < n_jobs && i < end; ++i) {
+    job = jobs->jobs[i];
+    memory = job->cmd->memory;
+    // NOTE: A job bigger than the budget may be running on its own.
+    if (job->state == BB_JOB_PENDING &&
+        jobs->memory_used < jobs->memory_budget &&
+        memory <= jobs->memory_budget - jobs->memory_used)
+      return job;
+  }
+  return NULL;
+}
+
+// With a GNU make jobserver, every job needs a token. A process owns one
+// token implicitly, and takes the others from the jobserver, a pipe or
+// fifo holding one byte per token, and writes them back when done. If bb
+// is run by make with a jobserver, it joins it. Otherwise, if asked to, it
+// serves its own, so that the builds it runs (make, ninja, or bb) share
+// its limit.
+static struct {
+  int active;
+  int read_fd;
+  int write_fd;
+  int nonblocking;    // Set if reading from read_fd never blocks.
+  int pipe_read_fd;   // The read end of the pipe we serve, if any.
+  int implicit_used;
+  char* tokens;       // Taken from the jobserver, to give back.
+  char* fifo_path;    // The fifo we serve, if any.
+  char* makeflags;    // MAKEFLAGS before we changed it, NULL if unset.
+  int serving;
+} _bb_jobserver;
+
+// Returns BB_TRUE if a job can be started now.
+static int _bb_jobserver_acquire(void) {
+#ifndef BB_PLATFORM_WINDOWS
+  struct pollfd fd;
+  bb_string_t error;
+  ssize_t n;
+  char token;
+
+  if (!_bb_jobserver.active)
+    return BB_TRUE;
+  if (!_bb_jobserver.implicit_used) {
+    _bb_jobserver.implicit_used = BB_TRUE;
+    return BB_TRUE;
+  }
+  if (!_bb_jobserver.nonblocking) {
+    // NOTE: Another process may take the token before we read it, and we
+    //       then block until one is given back.
+    fd.fd = _bb_jobserver.read_fd;
+    fd.events = POLLIN;
+    if (poll(&fd, 1, 0) == 0)
+      return BB_FALSE;
+  }
+  do
+    n = read(_bb_jobserver.read_fd, &token, 1);
+  while (n < 0 && errno == EINTR);
+  if (n == 1) {
+    bb_vector_push(_bb_jobserver.tokens, char, token);
+    return BB_TRUE;
+  }
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return BB_FALSE;
+  // NOTE: The jobserver is gone, so we are on our own.
+  error = n < 0 ? _bb_strerror() : bb_string_from_cstr("closed");
+  bb_warn("Could not read from the jobserver: %s", error->cstr);
+  bb_string_destroy(&error);
+  _bb_jobserver.active = BB_FALSE;
+#endif
+  return BB_TRUE;
+}
+
+static void _bb_jobserver_release(void) {
+#ifndef BB_PLATFORM_WINDOWS
+  char token;
+
+  if (!_bb_jobserver.active)
+    return;
+  if (bb_vector_pop(_bb_jobserver.tokens, &token) < 0) {
+    _bb_jobserver.implicit_used = BB_FALSE;
+    return;
+  }
+  while (write(_bb_jobserver.write_fd, &token, 1) < 0) {
+    if (errno != EINTR) {
+      bb_warn("Could not give a token back to the jobserver");
+      break;
+    }
+  }
+#endif
+}
+
+#ifndef BB_PLATFORM_WINDOWS
+// Open the read end of a jobserver pipe again, to read from it without
+// blocking. Setting O_NONBLOCK on fd instead would change it for make and
+// every other process sharing the pipe, which may not expect it. Returns
+// -1 where that's not possible.
+static int _bb_jobserver_reopen(int fd) {
+#ifdef BB_PLATFORM_LINUX
+  char path[64];
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  return open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+#else
+  BB_UNUSED(fd);
+  return -1;
+#endif
+}
+
+// Join the jobserver described by MAKEFLAGS, with --jobserver-auth=R,W
+// (pipe) or --jobserver-auth=fifo:PATH. Returns BB_FALSE if there is none,
+// or it cannot be used.
+static int _bb_jobserver_join(const char* makeflags) {
+  const char *auth = NULL, *arg;
+  bb_string_t path;
+  int read_fd, write_fd, private_fd;
+
+  // NOTE: The last option wins, and make before 4.2 calls it
+  //       --jobserver-fds.
+  for (arg = makeflags; (arg = strstr(arg, "--jobserver-")) != NULL; ++arg) {
+    if (!strncmp(arg, "--jobserver-auth=", 17))
+      auth = arg + 17;
+    else if (!strncmp(arg, "--jobserver-fds=", 16))
+      auth = arg + 16;
+  }
+  if (auth == NULL)
+    return BB_FALSE;
+
+  if (!strncmp(auth, "fifo:", 5)) {
+    path = bb_string_default();
+    bb_string_concat_n(path, auth + 5, strcspn(auth + 5, " "));
+    read_fd = open(path->cstr, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (read_fd < 0)
+      bb_warn("Could not open jobserver fifo %s", path->cstr);
+    bb_string_destroy(&path);
+    if (read_fd < 0)
+      return BB_FALSE;
+    write_fd = read_fd;
+    _bb_jobserver.nonblocking = BB_TRUE;
+  } else {
+    if (sscanf(auth, "%d,%d", &read_fd, &write_fd) != 2)
+      return BB_FALSE;
+    if (read_fd < 0 || fcntl(read_fd, F_GETFD) < 0 ||
+        write_fd < 0 || fcntl(write_fd, F_GETFD) < 0) {
+      // NOTE: make only passes the pipe to recipes marked as recursive.
+      bb_warn("Jobserver pipe is not open, prefix the make recipe with +");
+      return BB_FALSE;
+    }
+    // NOTE: Reads must not block, as we wait for tokens and jobs at once.
+    private_fd = _bb_jobserver_reopen(read_fd);
+    _bb_jobserver.nonblocking = private_fd >= 0;
+    if (private_fd >= 0)
+      read_fd = private_fd;
+  }
+  _bb_jobserver.read_fd = read_fd;
+  _bb_jobserver.write_fd = write_fd;
+  return BB_TRUE;
+}
+
+// Serve a jobserver for max_jobs jobs, through a fifo or a pipe, and export
+// it through MAKEFLAGS to the processes we run.
+static void _bb_jobserver_serve(size_t max_jobs, int use_pipe) {
+  bb_string_t makeflags, error;
+  const char* tmp_dir;
+  char path[4096];
+  int fds[2];
+  char token = '+';
+
+  makeflags = bb_string_default();
+  if (_bb_jobserver.makeflags != NULL)
+    bb_string_concat(makeflags, _bb_jobserver.makeflags);
+  bb_string_appendf(makeflags, " -j%zu --jobserver-auth=", max_jobs);
+  if (use_pipe) {
+    // NOTE: Unlike everything else, the pipe is inherited by children.
+    if (pipe(fds) < 0)
+      goto fail;
+    bb_string_appendf(makeflags, "%d,%d", fds[0], fds[1]);
+  } else {
+    tmp_dir = getenv("TMPDIR");
+    snprintf(path, sizeof(path), "%s/bb-jobserver-%u",
+             tmp_dir != NULL && *tmp_dir != '\0' ? tmp_dir : "/tmp",
+             (unsigned int)getpid());
+    _bb_jobserver.fifo_path = bb_strdup(path);
+    unlink(_bb_jobserver.fifo_path);
+    if (mkfifo(_bb_jobserver.fifo_path, 0600) < 0)
+      goto fail;
+    fds[0] = fds[1] = open(_bb_jobserver.fifo_path,
+                           O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fds[0] < 0)
+      goto fail;
+    bb_string_concat(makeflags, "fifo:");
+    bb_string_concat(makeflags, _bb_jobserver.fifo_path);
+  }
+  // Our own token is implicit.
+  for (size_t i = 1; i < max_jobs; ++i) {
+    if (write(fds[1], &token, 1) != 1)
+      goto fail;
+  }
+  if (setenv("MAKEFLAGS", makeflags->cstr, 1) < 0)
+    goto fail;
+  bb_string_destroy(&makeflags);
+  _bb_jobserver.read_fd = fds[0];
+  _bb_jobserver.write_fd = fds[1];
+  _bb_jobserver.nonblocking = BB_TRUE;
+  if (use_pipe) {
+    // NOTE: The children share the pipe, so we read through our own
+    //       description, which does not block (see the client side).
+    _bb_jobserver.pipe_read_fd = fds[0];
+    _bb_jobserver.read_fd = _bb_jobserver_reopen(fds[0]);
+    _bb_jobserver.nonblocking = _bb_jobserver.read_fd >= 0;
+    if (_bb_jobserver.read_fd < 0)
+      _bb_jobserver.read_fd = fds[0];
+  }
+  _bb_jobserver.serving = BB_TRUE;
+  return;
+
+fail:
+  error = _bb_strerror();
+  bb_crit("Could not create a jobserver: %s", error->cstr);
+}
+#endif
+
+// Stop using the jobserver, giving back the tokens we hold and, if we
+// serve it, removing it.
+static void _bb_jobserver_close(void) {
+#ifndef BB_PLATFORM_WINDOWS
+  char token;
+
+  if (_bb_jobserver.tokens == NULL)
+    return;
+  while (_bb_jobserver.active &&
+         bb_vector_pop(_bb_jobserver.tokens, &token) >= 0) {
+    if (write(_bb_jobserver.write_fd, &token, 1) < 0 && errno != EINTR)
+      break;
+  }
+  bb_vector_destroy(&_bb_jobserver.tokens);
+  if (_bb_jobserver.serving) {
+    close(_bb_jobserver.read_fd);
+    if (_bb_jobserver.write_fd != _bb_jobserver.read_fd)
+      close(_bb_jobserver.write_fd);
+    if (_bb_jobserver.fifo_path == NULL &&
+        _bb_jobserver.pipe_read_fd != _bb_jobserver.read_fd)
+      close(_bb_jobserver.pipe_read_fd);
+    if (_bb_jobserver.fifo_path != NULL) {
+      unlink(_bb_jobserver.fifo_path);
+      bb_free(&_bb_jobserver.fifo_path);
+    }
+    if (_bb_jobserver.makeflags != NULL)
+      setenv("MAKEFLAGS", _bb_jobserver.makeflags, 1);
+    else
+      unsetenv("MAKEFLAGS");
+  }
+  _bb_jobserver.active = BB_FALSE;
+  _bb_jobserver.serving = BB_FALSE;
+#endif
+}
+
+// Join the jobserver of the make running us, if any. Otherwise, with the
+// "pipe" or "fifo" style, serve one for max_jobs jobs. With "auto", we
+// only join, and with "none" we do neither.
+static void _bb_jobserver_setup(const char* style, size_t max_jobs) {
+  if (!strcmp(style, "none"))
+    return;
+  if (strcmp(style, "auto") && strcmp(style, "fifo") && strcmp(style, "pipe"))
+    bb_crit("Unknown jobserver style %s, expected auto, fifo, pipe or none",
+            style);
+#ifdef BB_PLATFORM_WINDOWS
+  // NOTE: On Windows, jobservers are semaphores, which are not supported.
+  BB_UNUSED(max_jobs);
+#else
+  const char* makeflags = getenv("MAKEFLAGS");
+  if (makeflags != NULL)
+    _bb_jobserver.makeflags = bb_strdup(makeflags);
+  if (makeflags == NULL || !_bb_jobserver_join(makeflags)) {
+    // NOTE: Serving changes MAKEFLAGS and leaks the pipe into every
+    //       child, so it's only done when asked for.
+    if (max_jobs <= 1 || !strcmp(style, "auto"))
+      return;
+    _bb_jobserver_serve(max_jobs, !strcmp(style, "pipe"));
+  }
+  _bb_jobserver.tokens = bb_vector_default(char);
+  _bb_jobserver.active = BB_TRUE;
+  atexit(_bb_jobserver_close);
+#endif
+}
+
+// Start pending jobs, in submission order as far as the memory limits
+// allow, until all slots are taken.
+static void _bb_jobs_fill(bb_jobs_t jobs) {
+  bb_job_t job;
+  size_t slot = 0;
+
+  jobs->throttled = BB_FALSE;
+  while (jobs->running < jobs->max_jobs &&
+         (job = _bb_jobs_next(jobs)) != NULL) {
+    if (!_bb_jobserver_acquire()) {
+      jobs->throttled = BB_TRUE;
+      break;
+    }
+    while (jobs->slots[slot] != NULL)
+      ++slot;
+    jobs->memory_used += job->cmd->memory;
+    job->start_time = _bb_time_ns();
+    job->proc = _bb_cmd_execute(job->cmd, &job->out_fd, &job->err_fd);
+    job->pid_fd = _bb_pidfd_open(job->proc);
+    job->state = BB_JOB_RUNNING;
+    jobs->slots[slot] = job;
+    ++jobs->running;
+  }
+}
+
+#ifndef BB_PLATFORM_WINDOWS
+// Mark the job in the given slot as done, and print its captured output.
+static bb_job_t _bb_jobs_finish(bb_jobs_t jobs, size_t slot, int wstatus,
+                                const struct rusage* ru) {
+  bb_job_t job = jobs->slots[slot];
+
+  _bb_usage_from_rusage(ru, &job->usage);
+  job->usage.wall_ns = _bb_time_ns() - job->start_time;
+  _bb_capture_close(&job->pid_fd);
+  // NOTE: Like bb_cmd_wait(..), we do not know which files the job touched.
+  if (!job->keep_stat_cache)
+    _bb_stat_invalidate_cwd();
+
+  if (WIFEXITED(wstatus))
+    job->exit_status = WEXITSTATUS(wstatus);
+  else {
+    bb_warn("Child process %u did not exit normally", _bb_proc_id(job->proc));
+    job->exit_status = EXIT_FAILURE;
+  }
+
+  if (job->cmd->capture) {
+    // Collect what was written right before exiting. Anything written
+    // later (e.g. by a grandchild holding the pipe) is dropped.
+    _bb_capture_read(&job->out_fd, job->cmd->out);
+    _bb_capture_read(&job->err_fd, job->cmd->err);
+    _bb_capture_close(&job->out_fd);
+    _bb_capture_close(&job->err_fd);
+    fwrite(job->cmd->out->cstr, 1, job->cmd->out->length, stdout);
+    fflush(stdout);
+    fwrite(job->cmd->err->cstr, 1, job->cmd->err->length, stderr);
+    fflush(stderr);
+  }
+
+  _bb_usage_record(job->cmd, &job->usage);
+  _bb_trace_cmd(job->cmd, slot + 1, job->proc, job->start_time,
+                job->exit_status, &job->usage);
+  // NOTE: The budget may have been exceeded by a job started on its own.
+  jobs->memory_used -= job->cmd->memory < jobs->memory_used
+                       ? job->cmd->memory : jobs->memory_used;
+  _bb_jobserver_release();
+  job->state = BB_JOB_DONE;
+  jobs->slots[slot] = NULL;
+  --jobs->running;
+  return job;
+}
+#endif
+
+// Wait for any running job to exit and free its slot, while collecting
+// the output of the jobs that capture it.
+static bb_job_t _bb_jobs_reap(bb_jobs_t jobs) {
+  bb_string_t error;
+#ifdef BB_PLATFORM_WINDOWS
+  BB_UNIMPLEMENTED_STUB();
+#else
+  struct pollfd* fds;
+  struct rusage ru;
+  bb_job_t job;
+  bb_proc_t proc;
+  size_t n_fds;
+  int wstatus, timeout;
+
+  fds = bb_malloc((3 * jobs->max_jobs + 1) * sizeof(*fds));
+  for (;;) {
+    n_fds = 0;
+    // NOTE: Jobs held back by memory pressure or waiting for a jobserver
+    //       token may be started later, so we have to check periodically.
+    timeout = jobs->throttled ? _BB_JOBS_POLL_MS : -1;
+    if (jobs->throttled && _bb_jobserver.active) {
+      fds[n_fds].fd = _bb_jobserver.read_fd;
+      fds[n_fds++].events = POLLIN;
+    }
+    for (size_t slot = 0; slot < jobs->max_jobs; ++slot) {
+      job = jobs->slots[slot];
+      if (job == NULL)
+        continue;
+      // NOTE: Only our jobs are waited for, not any child, which could
+      //       belong to bb_cmd_run_async(..) or another job queue. The end
+      //       of the output of a job does not tell when it exits either,
+      //       since a grandchild may hold the pipes open long after.
+      proc = wait4(job->proc, &wstatus, WNOHANG, &ru);
+      if (proc < 0 && errno != EINTR)
+        goto fail;
+      if (proc > 0) {
+        bb_free(&fds);
+        return _bb_jobs_finish(jobs, slot, wstatus, &ru);
+      }
+      if (job->pid_fd >= 0) {
+        fds[n_fds].fd = job->pid_fd;
+        fds[n_fds++].events = POLLIN;
+      } else
+        timeout = _BB_JOBS_POLL_MS;
+      if (job->out_fd >= 0) {
+        fds[n_fds].fd = job->out_fd;
+        fds[n_fds++].events = POLLIN;
+      }
+      if (job->err_fd >= 0) {
+        fds[n_fds].fd = job->err_fd;
+        fds[n_fds++].events = POLLIN;
+      }
+    }
+
+    if (poll(fds, n_fds, timeout) < 0 && errno != EINTR)
+      goto fail;
+    for (size_t slot = 0; slot < jobs->max_jobs; ++slot) {
+      job = jobs->slots[slot];
+      if (job == NULL || !job->cmd->capture)
+        continue;
+      for (size_t i = 0; i < n_fds; ++i) {
+        if (fds[i].revents == 0)
+          continue;
+        if (fds[i].fd == job->out_fd)
+          _bb_capture_read(&job->out_fd, job->cmd->out);
+        else if (fds[i].fd == job->err_fd)
+          _bb_capture_read(&job->err_fd, job->cmd->err);
+      }
+    }
+    if (jobs->throttled)
+      _bb_jobs_fill(jobs);
+  }
+#endif
+
+fail:
+  error = _bb_strerror();
+  bb_crit("Could not wait for jobs: %s", error->cstr);
+}
+
+bb_job_t bb_jobs_submit(bb_jobs_t jobs, bb_cmd_t* cmd) {
+  bb_job_t job;
+
+  bb_assert(jobs != NULL);
+  bb_assert(cmd != NULL);
+  bb_assert(*cmd != NULL);
+
+  job = bb_malloc(sizeof(*job));
+  job->id = bb_vector_length(jobs->jobs);
+  job->state = BB_JOB_PENDING;
+  job->exit_status = EXIT_FAILURE;
+  // The job queue takes ownership of the command.
+  job->cmd = *cmd;
+  job->out_fd = job->err_fd = job->pid_fd = -1;
+  job->start_time = 0;
+  memset(&job->usage, 0, sizeof(job->usage));
+  job->keep_stat_cache = BB_FALSE;
+  job->data = NULL;
+  *cmd = NULL;
+
+  bb_vector_push(jobs->jobs, bb_job_t, job);
+  _bb_jobs_fill(jobs);
+  return job;
+}
+
+// Let bb_jobs_wait_any(..) return again the jobs submitted before the one
+// with id first_job, that it returned since next_done was from, e.g. jobs
+// of the caller that finished while a graph was built on the same queue.
+static void _bb_jobs_give_back(bb_jobs_t jobs, size_t from,
+                               size_t first_job) {
+  bb_job_t* given;
+  size_t kept = from;
+
+  given = bb_vector_default(bb_job_t);
+  for (size_t i = from; i < jobs->next_done; ++i) {
+    if (jobs->done[i]->id < first_job)
+      bb_vector_push(given, bb_job_t, jobs->done[i]);
+    else
+      jobs->done[kept++] = jobs->done[i];
+  }
+  // NOTE: They keep the order they finished in.
+  for (size_t i = 0; i < bb_vector_length(given); ++i)
+    jobs->done[kept + i] = given[i];
+  jobs->next_done = kept;
+  bb_vector_destroy(&given);
+}
+
+bb_job_t bb_jobs_wait_any(bb_jobs_t jobs) {
+  bb_job_t job;
+
+  bb_assert(jobs != NULL);
+
+  if (jobs->next_done == bb_vector_length(jobs->done)) {
+    // NOTE: Pending jobs may be waiting for a jobserver token, even if
+    //       none are running.
+    if (jobs->running == 0 && !jobs->throttled)
+      return NULL;
+    job = _bb_jobs_reap(jobs);
+    bb_vector_push(jobs->done, bb_job_t, job);
+    _bb_jobs_fill(jobs);
+  }
+  return jobs->done[jobs->next_done++];
+}
+
+size_t bb_jobs_wait_all(bb_jobs_t jobs) {
+  size_t failed = 0;
+
+  bb_assert(jobs != NULL);
+
+  while (bb_jobs_wait_any(jobs) != NULL)
+    ;
+  for (size_t i = 0; i < bb_vector_length(jobs->jobs); ++i) {
+    if (jobs->jobs[i]->exit_status != 0)
+      ++failed;
+  }
+  return failed;
+}
+
+void bb_jobs_destroy(bb_jobs_t* jobs) {
+  bb_job_t job;
+
+  bb_assert(jobs != NULL);
+  bb_assert(*jobs != NULL);
+
+  bb_jobs_wait_all(*jobs);
+  for (size_t i = 0; i < bb_vector_length((*jobs)->jobs); ++i) {
+    job = (*jobs)->jobs[i];
+    bb_cmd_destroy(&job->cmd);
+    bb_free(&job);
+  }
+  bb_vector_destroy(&(*jobs)->jobs);
+  bb_vector_destroy(&(*jobs)->done);
+  bb_free(&(*jobs)->slots);
+  bb_free(jobs);
+}
+
+bb_graph_t bb_graph_new(void) {
+  bb_graph_t graph = bb_malloc(sizeof(*graph));
+  graph->nodes = bb_vector_default(bb_graph_node_t);
+  graph->rules = bb_vector_default(bb_rule_t);
+  graph->index = bb_map_new(size_t);
+  graph->arena = bb_arena_new(0);
+  return graph;
+}
+
+static size_t _bb_graph_node(bb_graph_t graph, const char* path) {
+  bb_graph_node_t node;
+  size_t *id, length;
+  uint64_t hash;
+
+  length = strlen(path);
+  hash = bb_map_hash(path, length);
+  id = bb_map_find_hashed(graph->index, path, length, hash);
+  if (id != NULL)
+    return *id;
+
+  node = bb_arena_alloc(graph->arena, sizeof(*node));
+  node->path = bb_arena_strdup(graph->arena, path);
+  node->producer = 0;
+  node->stated = BB_FALSE;
+  node->hashed = BB_FALSE;
+  node->mtime = 0;
+  node->size = 0;
+  bb_vector_push(graph->nodes, bb_graph_node_t, node);
+  *(size_t*)bb_map_insert_hashed(graph->index, path, length, hash, NULL) =
+    bb_vector_length(graph->nodes) - 1;
+  return bb_vector_length(graph->nodes) - 1;
+}
+
+static time_t _bb_graph_node_mtime(bb_graph_node_t node) {
+  // NOTE: Every file is stat'ed at most once per build, unless a rule
+  //       producing it runs in the meantime.
+  if (!node->stated) {
+    if (!_bb_file_get_info(node->path, &node->mtime, &node->size))
+      node->mtime = node->size = 0;
+    node->stated = BB_TRUE;
+  }
+  return node->mtime;
+}
+
+static void _bb_graph_node_invalidate(bb_graph_node_t node) {
+  _bb_stat_invalidate(node->path, BB_FALSE);
+  node->stated = BB_FALSE;
+  node->hashed = BB_FALSE;
+}
+
+static uint64_t _bb_graph_node_hash(bb_graph_node_t node,
+                                    const _bb_db_input_t* prev) {
+  if (node->hashed)
+    return node->hash;
+  _bb_graph_node_mtime(node);
+  // Only read the file if it changed since it was last hashed.
+  if (prev != NULL && prev->mtime == node->mtime && prev->size == node->size)
+    node->hash = prev->hash;
+  else if (node->mtime == 0 || !_bb_file_hash(node->path, &node->hash))
+    node->hash = 0;
+  node->hashed = BB_TRUE;
+  return node->hash;
+}
+
+bb_rule_t bb_graph_add_rule(bb_graph_t graph, bb_cmd_t* recipe) {
+  bb_rule_t rule;
+
+  bb_assert(graph != NULL);
+  bb_assert(recipe != NULL);
+  bb_assert(*recipe != NULL);
+
+  rule = bb_malloc(sizeof(*rule));
+  rule->id = bb_vector_length(graph->rules);
+  rule->state = BB_RULE_WAITING;
+  rule->blocked = BB_FALSE;
+  rule->pending = 0;
+  rule->depfile = 0;
+  // The graph takes ownership of the recipe, and runs a copy of it
+  // every time the rule is dirty.
+  rule->recipe = *recipe;
+  rule->inputs = bb_vector_default(size_t);
+  rule->outputs = bb_vector_default(size_t);
+  rule->discovered = bb_vector_default(size_t);
+  rule->dependents = NULL;
+  rule->cache_key[0] = rule->cache_key[1] = 0;
+  *recipe = NULL;
+
+  bb_vector_push(graph->rules, bb_rule_t, rule);
+  return rule;
+}
+
+void _bb_graph_add_inputs(bb_graph_t graph, bb_rule_t rule, ...) {
+  const char* path;
+  va_list ap;
+
+  bb_assert(graph != NULL);
+  bb_assert(rule != NULL);
+
+  va_start(ap, rule);
+  while ((path = va_arg(ap, const char*)) != NULL)
+    bb_vector_push(rule->inputs, size_t, _bb_graph_node(graph, path));
+  va_end(ap);
+}
+
+void _bb_graph_add_outputs(bb_graph_t graph, bb_rule_t rule, ...) {
+  bb_graph_node_t node;
+  const char* path;
+  size_t id;
+  va_list ap;
+
+  bb_assert(graph != NULL);
+  bb_assert(rule != NULL);
+
+  va_start(ap, rule);
+  while ((path = va_arg(ap, const char*)) != NULL) {
+    id = _bb_graph_node(graph, path);
+    node = graph->nodes[id];
+    if (node->producer != 0 && node->producer != rule->id + 1)
+      bb_crit("Multiple rules produce %s", path);
+    node->producer = rule->id + 1;
+    bb_vector_push(rule->outputs, size_t, id);
+  }
+  va_end(ap);
+}
+
+void bb_graph_set_depfile(bb_graph_t graph, bb_rule_t rule,
+                          const char* path) {
+  bb_assert(graph != NULL);
+  bb_assert(rule != NULL);
+  bb_assert(path != NULL);
+  rule->depfile = _bb_graph_node(graph, path) + 1;
+}
+
+// Parse a Makefile-style dependency file, as generated by GCC and Clang
+// with -MD/-MMD, appending the prerequisites to deps, separated by NULs.
+// Returns the number of prerequisites found.
+static size_t _bb_depfile_parse(const char* data, size_t size,
+                                bb_string_t deps) {
+  const char* end = data + size;
+  size_t count = 0, length;
+  int in_prereqs = BB_FALSE, is_target_end;
+  char c;
+
+  while (data < end) {
+    c = *data;
+    if (c == '\\' && data + 1 < end &&
+        (data[1] == '\n' || data[1] == '\r')) {
+      data += 2; // Line continuation.
+      if (data[-1] == '\r' && data < end && *data == '\n')
+        ++data;
+      continue;
+    }
+    if (c == '\n') {
+      in_prereqs = BB_FALSE;
+      ++data;
+      continue;
+    }
+    if (c == ' ' || c == '\t' || c == '\r') {
+      ++data;
+      continue;
+    }
+
+    length = deps->length;
+    is_target_end = BB_FALSE;
+    for (; data < end; ++data) {
+      c = *data;
+      if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+        break;
+      if (c == '\\' && data + 1 < end) {
+        if (data[1] == '\n' || data[1] == '\r')
+          break;
+        if (data[1] == ' ' || data[1] == '#')
+          c = *(++data);
+      } else if (c == '$' && data + 1 < end && data[1] == '$')
+        ++data;
+      else if (c == ':' && !in_prereqs &&
+               (data + 1 == end || isspace((unsigned char)data[1]))) {
+        // NOTE: A colon not followed by a space is part of the path
+        //       (e.g. C:\foo.h).
+        ++data;
+        is_target_end = BB_TRUE;
+        break;
+      }
+      bb_string_append(deps, c);
+    }
+
+    if (!in_prereqs) {
+      // Drop the target names.
+      deps->length = length;
+      deps->cstr[length] = '\0';
+      in_prereqs = is_target_end;
+    } else if (deps->length > length) {
+      bb_string_append(deps, '\0');
+      ++count;
+    }
+  }
+  return count;
+}
+
+// Load the inputs listed in the rule's depfile. The parsed depfile is
+// cached in the build database, so that it's only parsed again when it
+// changes. Returns BB_FALSE if the depfile does not exist.
+static int _bb_graph_rule_load_deps(bb_graph_t graph, bb_rule_t rule,
+                                    _bb_db_t db) {
+  const _bb_db_deps_t* cached;
+  _bb_db_deps_t* record;
+  bb_graph_node_t depfile;
+  bb_string_t deps;
+  const char *path, *end;
+  bb_file_view_t view;
+  uint64_t key;
+  size_t size, count;
+
+  bb_vector_clear(rule->discovered);
+
+  depfile = graph->nodes[rule->depfile - 1];
+  if (_bb_graph_node_mtime(depfile) == 0)
+    return BB_FALSE;
+
+  key = _bb_hash_cstr(depfile->path, _BB_DB_KEY_DEPS);
+  cached = _bb_db_get(db, key, &size);
+  if (cached != NULL && size >= sizeof(*cached) &&
+      cached->mtime == depfile->mtime && cached->size == depfile->size) {
+    path = cached->paths;
+    end = (const char*)cached + size;
+    for (count = 0; count < cached->count && path < end; ++count) {
+      if (memchr(path, '\0', end - path) == NULL)
+        break;
+      bb_vector_push(rule->discovered, size_t, _bb_graph_node(graph, path));
+      path += strlen(path) + 1;
+    }
+    if (count == cached->count)
+      return BB_TRUE;
+    // The record is corrupt, parse the depfile again.
+    bb_vector_clear(rule->discovered);
+  }
+
+  view = _bb_file_view_open(depfile->path);
+  if (view == NULL)
+    return BB_FALSE;
+  deps = bb_string_default();
+  count = _bb_depfile_parse(view->data, view->size, deps);
+  bb_file_view_close(&view);
+
+  size = sizeof(*record) + deps->length;
+  record = bb_malloc(size);
+  record->mtime = depfile->mtime;
+  record->size = depfile->size;
+  record->count = count;
+  memcpy(record->paths, deps->cstr, deps->length);
+  _bb_db_put(db, key, record, size);
+  bb_free(&record);
+
+  for (path = deps->cstr; count-- > 0; path += strlen(path) + 1)
+    bb_vector_push(rule->discovered, size_t, _bb_graph_node(graph, path));
+  bb_string_destroy(&deps);
+  return BB_TRUE;
+}
+
+static inline size_t _bb_graph_rule_n_inputs(bb_rule_t rule) {
+  return bb_vector_length(rule->inputs) + bb_vector_length(rule->discovered);
+}
+
+// Inputs of a rule are the ones given explicitly, followed by the ones
+// found in its depfile.
+static inline bb_graph_node_t _bb_graph_rule_input(bb_graph_t graph,
+                                                   bb_rule_t rule, size_t i) {
+  size_t n_explicit = bb_vector_length(rule->inputs);
+  if (i < n_explicit)
+    return graph->nodes[rule->inputs[i]];
+  return graph->nodes[rule->discovered[i - n_explicit]];
+}
+
+static const char* _bb_graph_rule_name(bb_graph_t graph, bb_rule_t rule) {
+  if (bb_vector_length(rule->outputs) == 0)
+    return rule->recipe->argv[0];
+  return graph->nodes[rule->outputs[0]]->path;
+}
+
+// Record the command and the inputs used to build the rule.
+static void _bb_graph_rule_record(bb_graph_t graph, bb_rule_t rule,
+                                  _bb_db_t db,
+                                  const _bb_db_target_t* prev) {
+  const _bb_db_input_t* prev_input;
+  _bb_db_target_t* record;
+  bb_graph_node_t node;
+  size_t n_inputs, size;
+
+  n_inputs = _bb_graph_rule_n_inputs(rule);
+  size = sizeof(*record) + n_inputs * sizeof(*record->inputs);
+  record = bb_malloc(size);
+  record->cmd = _bb_cmd_hash(rule->recipe);
+  record->count = n_inputs;
+  for (size_t i = 0; i < n_inputs; ++i) {
+    node = _bb_graph_rule_input(graph, rule, i);
+    record->inputs[i].path = _bb_hash_cstr(node->path, 0);
+    prev_input = prev != NULL && i < prev->count &&
+                 prev->inputs[i].path == record->inputs[i].path ?
+                 &prev->inputs[i] : NULL;
+    record->inputs[i].hash = _bb_graph_node_hash(node, prev_input);
+    record->inputs[i].mtime = node->mtime;
+    record->inputs[i].size = node->size;
+  }
+  _bb_db_put(db, _bb_hash_cstr(_bb_graph_rule_name(graph, rule),
+                               _BB_DB_KEY_TARGET),
+             record, size);
+  bb_free(&record);
+}
+
+// Returns 1 if the rule must run, 0 if it's up to date, and -1 if it
+// cannot run at all.
+static int _bb_graph_rule_is_dirty(bb_graph_t graph, bb_rule_t rule,
+                                   _bb_db_t db) {
+  const _bb_db_target_t* target;
+  const _bb_db_input_t* prev;
+  bb_graph_node_t node;
+  size_t n_inputs;
+  int stale = BB_FALSE;
+
+  n_inputs = bb_vector_length(rule->inputs);
+  for (size_t i = 0; i < n_inputs; ++i) {
+    node = graph->nodes[rule->inputs[i]];
+    if (_bb_graph_node_mtime(node) == 0 && node->producer == 0) {
+      bb_error("Missing file %s, needed by %s",
+               node->path, _bb_graph_rule_name(graph, rule));
+      return -1;
+    }
+  }
+
+  if (bb_vector_length(rule->outputs) == 0)
+    return 1;
+  for (size_t i = 0; i < bb_vector_length(rule->outputs); ++i) {
+    if (_bb_graph_node_mtime(graph->nodes[rule->outputs[i]]) == 0)
+      return 1;
+  }
+  if (rule->depfile != 0 && !_bb_graph_rule_load_deps(graph, rule, db))
+    return 1;
+  n_inputs = _bb_graph_rule_n_inputs(rule);
+
+  // NOTE: Modification times are only used to avoid hashing files that
+  //       did not change. The rule is dirty if the command or the contents
+  //       of any input differ from the last time it was built.
+  target = _bb_db_get_target(db, _bb_graph_rule_name(graph, rule),
+                             _BB_DB_KEY_TARGET);
+  if (target == NULL || target->count != n_inputs ||
+      target->cmd != _bb_cmd_hash(rule->recipe))
+    return 1;
+  for (size_t i = 0; i < n_inputs; ++i) {
+    node = _bb_graph_rule_input(graph, rule, i);
+    prev = &target->inputs[i];
+    if (_bb_graph_node_mtime(node) == 0 ||
+        prev->path != _bb_hash_cstr(node->path, 0))
+      return 1;
+    if (_bb_graph_node_hash(node, prev) != prev->hash)
+      return 1;
+    if (node->mtime != prev->mtime || node->size != prev->size)
+      stale = BB_TRUE;
+  }
+
+  // Refresh the recorded modification times, so that the inputs are not
+  // hashed again next time.
+  if (stale)
+    _bb_graph_rule_record(graph, rule, db, target);
+  return 0;
+}
+
+static void _bb_graph_make_output_dirs(bb_graph_t graph, bb_rule_t rule) {
+  for (size_t i = 0; i < bb_vector_length(rule->outputs); ++i)
+    _bb_file_makedirs_for(graph->nodes[rule->outputs[i]]->path);
+}
+
+// Mark a rule as finished, and queue the dependents that became ready.
+static void _bb_graph_rule_finish(bb_graph_t graph, bb_rule_t rule,
+                                  bb_rule_state_t state, bb_rule_t** ready) {
+  bb_rule_t dependent;
+
+  rule->state = state;
+  for (size_t i = 0; i < bb_vector_length(rule->dependents); ++i) {
+    dependent = graph->rules[rule->dependents[i]];
+    if (state == BB_RULE_FAILED)
+      dependent->blocked = BB_TRUE;
+    if (--dependent->pending == 0)
+      bb_vector_push(*ready, bb_rule_t, dependent);
+  }
+}
+
+// The compilation cache stores the outputs of compile commands (those with
+// a -c flag), keyed on their preprocessed input, their arguments and the
+// compiler binary. Entries are directories, named after the key, holding
+// the outputs (as 0, 1, ...) and the depfile (as d). The modification time
+// of an entry is updated when it's used, and the least recently used
+// entries are evicted when the cache grows too big. Its size is kept in
+// the size file, next to the entries.
+static struct {
+  char* dir;           // NULL if the cache is disabled.
+  uint64_t max_size;
+  int hardlink;        // Link outputs to the entries, instead of copying.
+  bb_map_t compilers;  // Compilers to the hash identifying them.
+  size_t hits;
+  size_t misses;
+  uint64_t stored;     // Bytes added to the cache during this run.
+} _bb_cache;
+
+// Enable the compilation cache for the graphs built from now on. If
+// max_size is 0, it's BB_CACHE_MAX_SIZE. Linking the outputs is faster
+// than copying them, where reflinks are not available, but the cache is
+// then corrupted if they are modified in place.
+void bb_cache_enable(const char* dir, uint64_t max_size, int hardlink) {
+  bb_string_t tmp;
+
+  bb_assert(dir != NULL && *dir != '\0');
+#ifdef BB_PLATFORM_WINDOWS
+  BB_UNIMPLEMENTED_STUB();
+#endif
+  if (_bb_cache.dir != NULL)
+    bb_free(&_bb_cache.dir);
+  else
+    _bb_cache.compilers = bb_map_new(uint64_t);
+  _bb_cache.dir = bb_path(dir);
+  _bb_cache.max_size = max_size > 0 ? max_size : BB_CACHE_MAX_SIZE;
+  _bb_cache.hardlink = hardlink;
+  tmp = bb_string_from_cstr(_bb_cache.dir);
+  bb_string_concat(tmp, "/tmp");
+  bb_file_makedirs(tmp->cstr, BB_TRUE);
+  bb_string_destroy(&tmp);
+}
+
+void bb_cache_stats(size_t* hits, size_t* misses) {
+  if (hits != NULL)
+    *hits = _bb_cache.hits;
+  if (misses != NULL)
+    *misses = _bb_cache.misses;
+}
+
+// Flags followed by a path, which do not change what is compiled.
+static int _bb_cache_is_path_flag(const char* arg) {
+  return !strcmp(arg, "-o") || !strcmp(arg, "-MF") ||
+         !strcmp(arg, "-MT") || !strcmp(arg, "-MQ");
+}
+
+// Returns a hash identifying the compiler binary, by its path, size and
+// modification time, or 0 if it cannot be found.
+static uint64_t _bb_cache_compiler_id(const char* compiler) {
+  const char *dirs, *end;
+  uint64_t *id, size, hash = 0;
+  time_t mtime;
+  bb_string_t path;
+  int is_dir;
+
+  id = bb_map_find_cstr(_bb_cache.compilers, compiler);
+  if (id != NULL)
+    return *id;
+
+  path = bb_string_default();
+  if (strchr(compiler, '/') != NULL)
+    bb_string_concat(path, compiler);
+  else {
+    // Look for it like execvp(..) would.
+    dirs = getenv("PATH");
+    for (; dirs != NULL && *dirs != '\0'; dirs = *end ? end + 1 : end) {
+      end = strchr(dirs, ':');
+      if (end == NULL)
+        end = dirs + strlen(dirs);
+      path->length = 0;
+      bb_string_concat_n(path, dirs, end - dirs);
+      if (path->length == 0)
+        bb_string_append(path, '.');
+      bb_string_append(path, '/');
+      bb_string_concat(path, compiler);
+      if (access(path->cstr, X_OK) == 0)
+        break;
+      path->length = 0;
+      path->cstr[0] = '\0';
+    }
+  }
+  if (path->length > 0 &&
+      _bb_file_stat(path->cstr, &mtime, &size, &is_dir) && !is_dir) {
+    hash = _bb_hash(path->cstr, path->length, size);
+    hash = _bb_hash(&mtime, sizeof(mtime), hash);
+  }
+  bb_string_destroy(&path);
+  bb_map_insert_cstr(_bb_cache.compilers, compiler, &hash);
+  return hash;
+}
+
+// If the rule compiles a file, returns the command that preprocesses it
+// into pp_path, and hashes everything else that affects the outputs.
+// Returns NULL if the rule cannot be cached.
+static bb_cmd_t _bb_cache_preprocess_cmd(bb_rule_t rule, const char* pp_path,
+                                         uint64_t* hash) {
+  bb_cmd_t recipe = rule->recipe, cmd;
+  const char* arg;
+  char cwd[4096];
+  int compiles = BB_FALSE, debug = BB_FALSE;
+
+  if (bb_vector_length(rule->outputs) == 0 || recipe->argc == 0)
+    return NULL;
+  *hash = _bb_cache_compiler_id(recipe->argv[0]);
+  if (*hash == 0)
+    return NULL;
+
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, recipe->argv[0]);
+  for (int i = 1; i < recipe->argc; ++i) {
+    arg = recipe->argv[i];
+    // NOTE: Flags that produce more files than we know about, or read
+    //       arguments from a file, are not supported.
+    if (!strcmp(arg, "-E") || !strcmp(arg, "-S") || !strcmp(arg, "-M") ||
+        !strcmp(arg, "-MM") || !strcmp(arg, "--coverage") ||
+        !strcmp(arg, "-ftest-coverage") || !strcmp(arg, "-gsplit-dwarf") ||
+        !strncmp(arg, "-save-temps", 11) || arg[0] == '@')
+      goto uncacheable;
+    if (_bb_cache_is_path_flag(arg)) {
+      ++i; // The output paths do not change the outputs.
+      continue;
+    }
+    if (!strncmp(arg, "-o", 2) || !strncmp(arg, "-MF", 3) ||
+        !strncmp(arg, "-MT", 3) || !strncmp(arg, "-MQ", 3))
+      continue;
+    *hash = _bb_hash_cstr(arg, *hash);
+    if (!strcmp(arg, "-c")) {
+      compiles = BB_TRUE;
+      arg = "-E";
+    } else if (!strcmp(arg, "-MD") || !strcmp(arg, "-MMD") ||
+               !strcmp(arg, "-MP"))
+      continue; // The depfile is written when compiling.
+    else if (!strncmp(arg, "-g", 2) && strcmp(arg, "-g0"))
+      debug = BB_TRUE;
+    bb_cmd_append_args(cmd, arg);
+  }
+  if (!compiles)
+    goto uncacheable;
+  bb_cmd_append_args(cmd, "-o", pp_path);
+  cmd->capture = recipe->capture;
+
+  for (int i = 0; i < recipe->envc; ++i) {
+    bb_cmd_append_envs(cmd, recipe->envp[i]);
+    *hash = _bb_hash_cstr(recipe->envp[i], *hash);
+  }
+  // NOTE: Debug information includes the working directory.
+  if (debug) {
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+      goto uncacheable;
+    *hash = _bb_hash_cstr(cwd, *hash);
+  }
+  return cmd;
+
+uncacheable:
+  bb_cmd_destroy(&cmd);
+  return NULL;
 }
 
-char* bb_args_next(int* argc, char*** argv) {
-  bb_assert(argc != NULL);
-  bb_assert(argv != NULL);
-  bb_assert(*argv != NULL);
-  if (*argc <= 0)
-    return NULL;
-  return ((*argv)++)[(*argc)--];
+// Temporary files are private to this process, and renamed into the cache
+// once complete.
+static void _bb_cache_tmp_path(bb_rule_t rule, const char* suffix,
+                               bb_string_t path) {
+  bb_string_concat(path, _bb_cache.dir);
+  bb_string_appendf(path, "/tmp/%u-%zu%s",
+                    (unsigned int)getpid(), rule->id, suffix);
 }
 
-bb_cmd_t bb_cmd_new(void) {
-  bb_cmd_t cmd = bb_malloc(sizeof(*cmd));
-  cmd->argc = cmd->envc = 0;
-  cmd->argv = bb_string_default();
-  cmd->envp = bb_string_default();
-  return cmd;
+static void _bb_cache_entry_path(bb_rule_t rule, bb_string_t path) {
+  bb_string_concat(path, _bb_cache.dir);
+  bb_string_appendf(path, "/%02x/%016llx%016llx",
+                    (unsigned int)(rule->cache_key[0] >> 56),
+                    (unsigned long long)rule->cache_key[0],
+                    (unsigned long long)rule->cache_key[1]);
 }
 
-static void _bb_cmd_append_strings(int* count, bb_string_t str, va_list ap) {
-  const char* s;
-  bb_assert(count != NULL);
-  bb_assert(str != NULL);
-  for (; (s = va_arg(ap, const char*)) != NULL; ++*count) {
-    if (str->length > 0)
-      bb_string_append(str, ' ');
-    bb_string_concat(str, s);
+// Start preprocessing the input of the rule, to look it up in the cache.
+// Returns BB_FALSE if the rule cannot be cached.
+static int _bb_cache_submit(bb_rule_t rule, bb_jobs_t jobs) {
+  bb_string_t pp_path;
+  bb_cmd_t cmd;
+  bb_job_t job;
+  uint64_t hash;
+
+  rule->cache_key[0] = rule->cache_key[1] = 0;
+  pp_path = bb_string_default();
+  _bb_cache_tmp_path(rule, ".i", pp_path);
+  cmd = _bb_cache_preprocess_cmd(rule, pp_path->cstr, &hash);
+  bb_string_destroy(&pp_path);
+  if (cmd == NULL)
+    return BB_FALSE;
+  // NOTE: Keep the hash of everything but the input until it's known.
+  rule->cache_key[0] = hash;
+  job = bb_jobs_submit(jobs, &cmd);
+  job->data = rule;
+  // NOTE: It only writes the preprocessed input, which is never stat'd.
+  job->keep_stat_cache = BB_TRUE;
+  rule->state = BB_RULE_CACHING;
+  return BB_TRUE;
+}
+
+// Compute the key of the rule from its preprocessed input. Returns
+// BB_FALSE if it could not be preprocessed.
+static int _bb_cache_compute_key(bb_rule_t rule, int exit_status) {
+  bb_file_view_t view = NULL;
+  bb_string_t pp_path;
+  uint64_t hash = rule->cache_key[0];
+
+  rule->cache_key[0] = rule->cache_key[1] = 0;
+  pp_path = bb_string_default();
+  _bb_cache_tmp_path(rule, ".i", pp_path);
+  if (exit_status == 0)
+    view = _bb_file_view_open(pp_path->cstr);
+  if (view != NULL) {
+    rule->cache_key[0] = _bb_hash(view->data, view->size, hash);
+    rule->cache_key[1] = _bb_hash(view->data, view->size, ~hash);
+    bb_file_view_close(&view);
   }
+  unlink(pp_path->cstr);
+  bb_string_destroy(&pp_path);
+  return rule->cache_key[0] != 0 || rule->cache_key[1] != 0;
 }
 
-void _bb_cmd_append_args(bb_cmd_t cmd, ...) {
-  va_list ap;
-  bb_assert(cmd != NULL);
-  va_start(ap, cmd);
-  _bb_cmd_append_strings(&cmd->argc, cmd->argv, ap);
-  va_end(ap);
+static void _bb_cache_file_path(bb_string_t entry, size_t i,
+                                bb_string_t path) {
+  path->length = 0;
+  bb_string_concat_n(path, entry->cstr, entry->length);
+  if (i == (size_t)-1)
+    bb_string_concat(path, "/d");
+  else
+    bb_string_appendf(path, "/%zu", i);
 }
 
-void _bb_cmd_append_envs(bb_cmd_t cmd, ...) {
-  va_list ap;
-  bb_assert(cmd != NULL);
-  va_start(ap, cmd);
-  _bb_cmd_append_strings(&cmd->envc, cmd->envp, ap);
-  va_end(ap);
+// Put src at dst, replacing it, by linking or copying it.
+static int _bb_cache_put(const char* src, const char* dst, int hardlink) {
+  if (unlink(dst) < 0 && errno != ENOENT)
+    return BB_FALSE;
+  if (hardlink && link(src, dst) == 0) {
+    _bb_stat_invalidate(dst, BB_FALSE);
+    return BB_TRUE;
+  }
+  // NOTE: Copying makes a reflink, where the filesystem supports it.
+  return _bb_file_copy(src, dst);
 }
 
-int bb_cmd_wait(bb_proc_t proc) {
-  bb_string_t error;
-#ifdef BB_PLATFORM_WINDOWS
-  DWORD exit_code;
-  if (WaitForSingleObject(proc, INFINITE) == WAIT_FAILED ||
-      !GetExitCodeProcess(proc, &exit_code))
-    goto fail;
-  return exit_code;
-#else
-  int wstatus;
-  if (waitpid(proc, &wstatus, 0) < 0 ||
-      !WIFEXITED(wstatus))
+// Materialize the outputs of the rule from the cache. Returns BB_FALSE on
+// a miss.
+static int _bb_cache_fetch(bb_graph_t graph, bb_rule_t rule) {
+  bb_string_t entry, src, error;
+  size_t n_outputs = bb_vector_length(rule->outputs);
+  const char* dst;
+  struct stat st;
+  int hit = BB_FALSE;
+
+  entry = bb_string_default();
+  src = bb_string_default();
+  _bb_cache_entry_path(rule, entry);
+
+  // Check that the entry is complete, before touching the outputs.
+  for (size_t i = 0; i < n_outputs; ++i) {
+    _bb_cache_file_path(entry, i, src);
+    if (stat(src->cstr, &st) < 0)
+      goto out;
+  }
+  if (rule->depfile != 0) {
+    _bb_cache_file_path(entry, -1, src);
+    if (stat(src->cstr, &st) < 0)
+      goto out;
+  }
+
+  for (size_t i = 0; i <= n_outputs; ++i) {
+    if (i == n_outputs) {
+      if (rule->depfile == 0)
+        break;
+      _bb_cache_file_path(entry, -1, src);
+      dst = graph->nodes[rule->depfile - 1]->path;
+    } else {
+      _bb_cache_file_path(entry, i, src);
+      dst = graph->nodes[rule->outputs[i]]->path;
+    }
+    if (!_bb_cache_put(src->cstr, dst, _bb_cache.hardlink)) {
+      error = _bb_strerror();
+      bb_warn("Could not restore %s from the cache: %s", dst, error->cstr);
+      bb_string_destroy(&error);
+      goto out;
+    }
+    // NOTE: A linked file keeps the modification time of the entry.
+    if (_bb_cache.hardlink)
+      utimensat(AT_FDCWD, dst, NULL, 0);
+  }
+  // Mark the entry as recently used.
+  utimensat(AT_FDCWD, entry->cstr, NULL, 0);
+  hit = BB_TRUE;
+
+out:
+  bb_string_destroy(&src);
+  bb_string_destroy(&entry);
+  return hit;
+}
+
+// Add the outputs of the rule, which just ran, to the cache.
+static void _bb_cache_store(bb_graph_t graph, bb_rule_t rule) {
+  bb_string_t entry, tmp, dst, error;
+  size_t n_outputs = bb_vector_length(rule->outputs);
+  const char* src;
+  uint64_t size = 0;
+  struct stat st;
+
+  entry = bb_string_default();
+  tmp = bb_string_default();
+  dst = bb_string_default();
+  _bb_cache_entry_path(rule, entry);
+  // NOTE: The entry is filled in elsewhere and then renamed, so that other
+  //       builds never see a partial entry.
+  _bb_cache_tmp_path(rule, "", tmp);
+  if (mkdir(tmp->cstr, 0777) < 0 && errno != EEXIST)
     goto fail;
-  return WEXITSTATUS(wstatus);
-#endif
+
+  for (size_t i = 0; i <= n_outputs; ++i) {
+    if (i == n_outputs) {
+      if (rule->depfile == 0)
+        break;
+      src = graph->nodes[rule->depfile - 1]->path;
+      _bb_cache_file_path(tmp, -1, dst);
+    } else {
+      src = graph->nodes[rule->outputs[i]]->path;
+      _bb_cache_file_path(tmp, i, dst);
+    }
+    if (stat(src, &st) < 0 || !_bb_cache_put(src, dst->cstr,
+                                             _bb_cache.hardlink))
+      goto fail;
+    size += st.st_size;
+  }
+
+  _bb_file_makedirs_for(entry->cstr);
+  if (rename(tmp->cstr, entry->cstr) < 0) {
+    // Another build stored the same entry in the meantime.
+    if (errno != EEXIST && errno != ENOTEMPTY)
+      goto fail;
+    _bb_file_delete(tmp->cstr, 1);
+  } else
+    _bb_cache.stored += size;
+  goto out;
+
 fail:
   error = _bb_strerror();
-  bb_warn("Could not wait for child process %u: %s",
-          _bb_proc_id(proc), error->cstr);
-  bb_info("Assuming child process failed");
+  bb_warn("Could not store %s in the cache: %s",
+          graph->nodes[rule->outputs[0]]->path, error->cstr);
   bb_string_destroy(&error);
-  return EXIT_FAILURE;
+  if (stat(tmp->cstr, &st) == 0)
+    _bb_file_delete(tmp->cstr, 1);
+out:
+  bb_string_destroy(&dst);
+  bb_string_destroy(&tmp);
+  bb_string_destroy(&entry);
 }
 
-static bb_string_t _bb_string_from_format(const char* fmt, va_list ap) {
-  bb_string_t out;
-  va_list orig;
-  char* buffer;
-  size_t buffer_size = 32768;
+typedef struct {
+  char* path;
+  time_t mtime;
+  uint64_t size;
+} _bb_cache_entry_t;
 
-  bb_assert(fmt != NULL);
+// Open a subdirectory of dir_fd for reading. Returns NULL if it's gone.
+static DIR* _bb_cache_opendir(int dir_fd, const char* name) {
+  DIR* dir;
+  int fd;
+
+  fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  dir = fdopendir(fd);
+  if (dir == NULL)
+    close(fd);
+  return dir;
+}
 
-  va_copy(orig, ap);
-  buffer = bb_malloc(buffer_size);
-  while (vsnprintf(buffer, buffer_size, fmt, ap) == buffer_size) {
-    buffer_size <<= 1;
-    buffer = bb_realloc(buffer, buffer_size);
-    va_copy(ap, orig);
+// List the entries of the cache, and return its total size. Unlike
+// bb_file_walk(..), this skips whatever another build removes during the
+// scan, instead of failing.
+static uint64_t _bb_cache_scan(_bb_cache_entry_t** entries) {
+  struct dirent *bucket_ent, *entry_ent, *file_ent;
+  DIR *root, *bucket, *entry_dir;
+  _bb_cache_entry_t entry;
+  bb_string_t path;
+  struct stat st;
+  uint64_t size = 0;
+
+  root = _bb_cache_opendir(AT_FDCWD, _bb_cache.dir);
+  if (root == NULL)
+    return 0;
+  path = bb_string_default();
+  while ((bucket_ent = readdir(root)) != NULL) {
+    // NOTE: Entries are two levels down, e.g. ab/ab01..., everything else
+    //       is skipped.
+    if (strlen(bucket_ent->d_name) != 2 || bucket_ent->d_name[0] == '.')
+      continue;
+    bucket = _bb_cache_opendir(dirfd(root), bucket_ent->d_name);
+    if (bucket == NULL)
+      continue;
+    while ((entry_ent = readdir(bucket)) != NULL) {
+      if (entry_ent->d_name[0] == '.')
+        continue;
+      entry_dir = _bb_cache_opendir(dirfd(bucket), entry_ent->d_name);
+      if (entry_dir == NULL)
+        continue;
+      if (fstat(dirfd(entry_dir), &st) < 0) {
+        closedir(entry_dir);
+        continue;
+      }
+      entry.mtime = st.st_mtime;
+      entry.size = 0;
+      while ((file_ent = readdir(entry_dir)) != NULL) {
+        if (fstatat(dirfd(entry_dir), file_ent->d_name, &st,
+                    AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode))
+          entry.size += st.st_size;
+      }
+      closedir(entry_dir);
+      path->length = 0;
+      bb_string_appendf(path, "%s/%s/%s", _bb_cache.dir,
+                        bucket_ent->d_name, entry_ent->d_name);
+      entry.path = bb_strdup(path->cstr);
+      bb_vector_push(*entries, _bb_cache_entry_t, entry);
+      size += entry.size;
+    }
+    closedir(bucket);
   }
-  out = bb_string_from_cstr(buffer);
-  bb_free(&buffer);
-  return out;
+  closedir(root);
+  bb_string_destroy(&path);
+  return size;
 }
 
-static char** _bb_string_to_null_terminated_array(bb_string_t str, char sep) {
-  char** array;
-  size_t elements;
-  char* occurrence = str->cstr;
+static int _bb_cache_entry_compare(const void* a, const void* b) {
+  const _bb_cache_entry_t* entry_a = a;
+  const _bb_cache_entry_t* entry_b = b;
+  return (entry_a->mtime > entry_b->mtime) - (entry_a->mtime < entry_b->mtime);
+}
 
-  bb_assert(str != NULL);
+// Evict the least recently used entries, until the cache is back under
+// 90% of its size limit. Returns the size of the cache afterwards.
+static uint64_t _bb_cache_evict(void) {
+  _bb_cache_entry_t* entries;
+  bb_string_t tmp;
+  uint64_t size;
+  size_t evicted = 0;
+
+  entries = bb_vector_default(_bb_cache_entry_t);
+  size = _bb_cache_scan(&entries);
+  if (size > _bb_cache.max_size) {
+    qsort(entries, bb_vector_length(entries), sizeof(*entries),
+          _bb_cache_entry_compare);
+    tmp = bb_string_default();
+    for (size_t i = 0; i < bb_vector_length(entries) &&
+                       size > _bb_cache.max_size / 10 * 9; ++i) {
+      // NOTE: The entry is moved out of the way first, so that it's gone
+      //       at once, and skipped if another build already removed it.
+      tmp->length = 0;
+      bb_string_appendf(tmp, "%s/tmp/%u-evict-%zu", _bb_cache.dir,
+                        (unsigned int)getpid(), i);
+      if (rename(entries[i].path, tmp->cstr) == 0) {
+        _bb_file_delete(tmp->cstr, 1);
+        ++evicted;
+      }
+      size -= entries[i].size;
+    }
+    bb_string_destroy(&tmp);
+    bb_info("Evicted %zu entries from the cache", evicted);
+  }
+
+  for (size_t i = 0; i < bb_vector_length(entries); ++i)
+    bb_free(&entries[i].path);
+  bb_vector_destroy(&entries);
+  return size;
+}
 
-  for (elements = 0; str->length > 0 && occurrence != NULL; ++elements)
-    occurrence = strchr(occurrence + 1, sep);
+// Add what this build stored to the size of the cache, which is kept in
+// its size file, so that it's only scanned when it has to be trimmed (or
+// the size is not known). The file is locked meanwhile, so that builds
+// sharing the cache neither lose each other's updates nor evict at once.
+static void _bb_cache_update_size(void) {
+  bb_string_t path, error;
+  char buffer[32];
+  uint64_t size = 0;
+  ssize_t n;
+  int fd, known;
+
+  path = bb_string_from_cstr(_bb_cache.dir);
+  bb_string_concat(path, "/size");
+  fd = open(path->cstr, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0 || flock(fd, LOCK_EX) < 0) {
+    error = _bb_strerror();
+    bb_warn("Could not update the size of the cache: %s", error->cstr);
+    bb_string_destroy(&error);
+    if (fd >= 0)
+      close(fd);
+    bb_string_destroy(&path);
+    return;
+  }
 
-  array = bb_malloc((elements + 1) * sizeof(*array));
-  array[0] = str->cstr;
-  for (size_t i = 1; i <= elements; ++i) {
-    array[i] = strchr(array[i-1], sep);
-    if (array[i] == NULL)
-      break;
-    *(array[i]++) = '\0';
+  n = pread(fd, buffer, sizeof(buffer) - 1, 0);
+  known = n > 0;
+  if (known) {
+    buffer[n] = '\0';
+    size = strtoull(buffer, NULL, 10);
   }
+  size += _bb_cache.stored;
+  if (!known || size > _bb_cache.max_size)
+    size = _bb_cache_evict();
 
-  return array;
+  n = snprintf(buffer, sizeof(buffer), "%llu\n", (unsigned long long)size);
+  if (ftruncate(fd, 0) < 0 || pwrite(fd, buffer, n, 0) != n) {
+    error = _bb_strerror();
+    bb_warn("Could not update the size of the cache: %s", error->cstr);
+    bb_string_destroy(&error);
+  }
+  close(fd);
+  bb_string_destroy(&path);
 }
 
-static bb_proc_t _bb_cmd_execute(bb_cmd_t cmd, va_list ap) {
-  bb_proc_t proc;
-  bb_string_t cmdline, cmdenv, error;
-  char **argv, **envp;
+// Remove a file if it has other links, e.g. from the compilation cache,
+// so that writing to it in place does not change them too.
+static void _bb_graph_unshare_file(const char* path) {
+#ifndef BB_PLATFORM_WINDOWS
+  struct stat info;
+  if (lstat(path, &info) == 0 && S_ISREG(info.st_mode) &&
+      info.st_nlink > 1)
+    unlink(path);
+#else
+  BB_UNUSED(path);
+#endif
+}
 
-  bb_assert(cmd != NULL);
+// Run the recipe of a rule. Unless its expected memory use is given, it's
+// what the rule used when it last ran.
+static void _bb_graph_rule_run(bb_graph_t graph, bb_rule_t rule,
+                               bb_jobs_t jobs, _bb_db_t db) {
+  const uint64_t* memory;
+  bb_cmd_t recipe;
+  bb_job_t job;
+  size_t size;
 
-  cmdline = _bb_string_from_format(cmd->argv->cstr, ap);
-  cmdenv = _bb_string_from_format(cmd->envp->cstr, ap);
-  bb_info("Executing: %s", cmdline->cstr);
-  if (cmd->envc > 0)
-    bb_info("- with environment: %s", cmdenv->cstr);
+  // NOTE: Outputs may still be linked to the cache, even if it's disabled
+  //       now, and recipes may write to them in place.
+  for (size_t i = 0; i < bb_vector_length(rule->outputs); ++i)
+    _bb_graph_unshare_file(graph->nodes[rule->outputs[i]]->path);
+  if (rule->depfile != 0)
+    _bb_graph_unshare_file(graph->nodes[rule->depfile - 1]->path);
+
+  recipe = bb_cmd_clone(rule->recipe);
+  if (recipe->memory == 0 && jobs->memory_budget > 0) {
+    memory = _bb_db_get(db, _bb_hash_cstr(_bb_graph_rule_name(graph, rule),
+                                          _BB_DB_KEY_MEMORY), &size);
+    if (memory != NULL && size == sizeof(*memory))
+      recipe->memory = *memory;
+  }
+  job = bb_jobs_submit(jobs, &recipe);
+  job->data = rule;
+  // NOTE: Only the outputs of the rule are invalidated once it's done.
+  job->keep_stat_cache = BB_TRUE;
+  rule->state = BB_RULE_RUNNING;
+}
 
-  envp = _bb_string_to_null_terminated_array(cmdenv, ' ');
-#ifdef BB_PLATFORM_WINDOWS
-  PROCESS_INFORMATION proc_info = {0};
-  STARTUPINFOA startup_info = {0};
-  startup_info.cb = sizeof(startup_info);
-  if (!CreateProcessA(NULL, cmdline->cstr, NULL, NULL,
-                      FALSE, NORMAL_PRIORITY_CLASS, envp,
-                      NULL, &startup_info, &proc_info))
-    goto fail;
-  proc = proc_info.hProcess;
-#else
-  argv = _bb_string_to_null_terminated_array(cmdline, ' ');
-  proc = fork();
-  if (proc < 0)
-    goto fail;
-  if (proc == 0) {
-    for (size_t e = 0; e < cmd->envc; ++e)
-      putenv(envp[e]);
-    if (execvp(argv[0], argv) < 0)
-      bb_crit("Could not execute command: %s", cmdline->cstr);
+size_t bb_graph_build(bb_graph_t graph, bb_jobs_t jobs) {
+  uint64_t start = bb_trace_begin(), evict_start;
+  bb_jobs_t own_jobs = NULL;
+  bb_rule_t rule, *ready;
+  bb_graph_node_t node;
+  bb_job_t job;
+  _bb_db_t db;
+  size_t n_rules, running = 0, ran = 0, failed = 0, hits, misses;
+  size_t first_job, first_done;
+  int dirty;
+
+  bb_assert(graph != NULL);
+
+  hits = _bb_cache.hits;
+  misses = _bb_cache.misses;
+  _bb_cache.stored = 0;
+
+  if (jobs == NULL)
+    jobs = own_jobs = bb_jobs_new(0);
+  // NOTE: The queue may also run jobs of the caller, which were submitted
+  //       before ours.
+  first_job = bb_vector_length(jobs->jobs);
+  first_done = jobs->next_done;
+
+  db = _bb_db_open(BB_DB_PATH);
+  for (size_t i = 0; i < bb_vector_length(graph->nodes); ++i) {
+    node = graph->nodes[i];
+    // NOTE: In watch mode the stat cache is kept up to date by file events,
+    //       so only what we know about the contents is dropped.
+    if (_bb_watch.active)
+      node->stated = node->hashed = BB_FALSE;
+    else
+      _bb_graph_node_invalidate(node);
   }
-  bb_free(&argv);
-#endif
-  bb_free(&envp);
 
-  bb_string_destroy(&cmdline);
-  bb_string_destroy(&cmdenv);
+  // Link every rule to the rules producing its inputs.
+  n_rules = bb_vector_length(graph->rules);
+  for (size_t i = 0; i < n_rules; ++i) {
+    rule = graph->rules[i];
+    rule->state = BB_RULE_WAITING;
+    rule->blocked = BB_FALSE;
+    rule->pending = 0;
+    rule->dependents = bb_vector_default(size_t);
+  }
+  for (size_t i = 0; i < n_rules; ++i) {
+    rule = graph->rules[i];
+    // NOTE: The inputs found in the depfile of the last build may be
+    //       generated too, e.g. headers, and must be written first.
+    if (rule->depfile != 0)
+      _bb_graph_rule_load_deps(graph, rule, db);
+    for (size_t j = 0; j < _bb_graph_rule_n_inputs(rule); ++j) {
+      node = _bb_graph_rule_input(graph, rule, j);
+      if (node->producer == 0 || node->producer - 1 == rule->id)
+        continue;
+      bb_vector_push(graph->rules[node->producer - 1]->dependents,
+                     size_t, rule->id);
+      ++rule->pending;
+    }
+  }
 
-  bb_info("- as process: %u", _bb_proc_id(proc));
+  ready = bb_vector_default(bb_rule_t);
+  for (size_t i = 0; i < n_rules; ++i) {
+    if (graph->rules[i]->pending == 0)
+      bb_vector_push(ready, bb_rule_t, graph->rules[i]);
+  }
 
-  return proc;
+  for (;;) {
+    while (bb_vector_length(ready) > 0) {
+      bb_vector_pop(ready, &rule);
+      if (rule->blocked) {
+        ++failed;
+        _bb_graph_rule_finish(graph, rule, BB_RULE_FAILED, &ready);
+        continue;
+      }
+      dirty = _bb_graph_rule_is_dirty(graph, rule, db);
+      if (dirty < 0) {
+        ++failed;
+        _bb_graph_rule_finish(graph, rule, BB_RULE_FAILED, &ready);
+      } else if (dirty == 0)
+        _bb_graph_rule_finish(graph, rule, BB_RULE_DONE, &ready);
+      else {
+        _bb_graph_make_output_dirs(graph, rule);
+        ++running;
+        if (_bb_cache.dir != NULL && _bb_cache_submit(rule, jobs))
+          continue;
+        rule->cache_key[0] = rule->cache_key[1] = 0;
+        _bb_graph_rule_run(graph, rule, jobs, db);
+        ++ran;
+      }
+    }
 
-fail:
-  error = _bb_strerror();
-  bb_crit("Could not run command: %s: %s",
-          cmdline->cstr, error->cstr);
-}
+    if (running == 0)
+      break;
 
-bb_proc_t _bb_cmd_run_async(bb_cmd_t cmd, ...) {
-  bb_proc_t proc;
-  va_list ap;
-  bb_assert(cmd != NULL);
-  va_start(ap, cmd);
-  proc = _bb_cmd_execute(cmd, ap);
-  va_end(ap);
-  return proc;
-}
+    job = bb_jobs_wait_any(jobs);
+    bb_assert(job != NULL);
+    if (job->id < first_job)
+      continue; // Not one of ours, it's given back below.
+    rule = job->data;
+    if (rule->state == BB_RULE_CACHING) {
+      if (_bb_cache_compute_key(rule, job->exit_status) &&
+          _bb_cache_fetch(graph, rule)) {
+        ++_bb_cache.hits;
+        --running;
+        bb_info("Restored %s from the cache",
+                _bb_graph_rule_name(graph, rule));
+      } else {
+        // NOTE: If preprocessing failed, compiling reports why.
+        ++_bb_cache.misses;
+        _bb_graph_rule_run(graph, rule, jobs, db);
+        ++ran;
+        continue;
+      }
+    } else {
+      --running;
+      // NOTE: Rules that failed, e.g. because they ran out of memory, are
+      //       the most important to remember.
+      if (rule->state == BB_RULE_RUNNING && job->usage.max_rss > 0)
+        _bb_db_put(db, _bb_hash_cstr(_bb_graph_rule_name(graph, rule),
+                                     _BB_DB_KEY_MEMORY),
+                   &job->usage.max_rss, sizeof(job->usage.max_rss));
+    }
+    // The outputs were (hopefully) just rewritten.
+    for (size_t i = 0; i < bb_vector_length(rule->outputs); ++i)
+      _bb_graph_node_invalidate(graph->nodes[rule->outputs[i]]);
+    if (rule->depfile != 0)
+      _bb_graph_node_invalidate(graph->nodes[rule->depfile - 1]);
+    if (rule->state != BB_RULE_CACHING && job->exit_status != 0) {
+      bb_error("Rule for %s failed with exit code %d",
+               _bb_graph_rule_name(graph, rule), job->exit_status);
+      ++failed;
+      _bb_graph_rule_finish(graph, rule, BB_RULE_FAILED, &ready);
+    } else {
+      if (rule->depfile != 0 && !_bb_graph_rule_load_deps(graph, rule, db))
+        bb_warn("Rule for %s did not generate depfile %s",
+                _bb_graph_rule_name(graph, rule),
+                graph->nodes[rule->depfile - 1]->path);
+      if (rule->state == BB_RULE_RUNNING &&
+          (rule->cache_key[0] != 0 || rule->cache_key[1] != 0))
+        _bb_cache_store(graph, rule);
+      if (bb_vector_length(rule->outputs) > 0)
+        _bb_graph_rule_record(graph, rule, db,
+                              _bb_db_get_target(db,
+                                _bb_graph_rule_name(graph, rule),
+                                _BB_DB_KEY_TARGET));
+      _bb_graph_rule_finish(graph, rule, BB_RULE_DONE, &ready);
+    }
+  }
 
-int _bb_cmd_run(bb_cmd_t cmd, ...) {
-  int exit_status;
-  va_list ap;
-  bb_assert(cmd != NULL);
-  va_start(ap, cmd);
-  exit_status = bb_cmd_wait(_bb_cmd_execute(cmd, ap));
-  va_end(ap);
-  return exit_status;
+  for (size_t i = 0; i < n_rules; ++i) {
+    rule = graph->rules[i];
+    if (rule->state == BB_RULE_WAITING)
+      bb_crit("Dependency cycle detected at %s",
+              _bb_graph_rule_name(graph, rule));
+    bb_vector_destroy(&rule->dependents);
+  }
+  bb_vector_destroy(&ready);
+  _bb_db_close(&db);
+
+  // Let watch mode know which files this build depends on.
+  for (size_t i = 0; _bb_watch.active && i < n_rules; ++i) {
+    rule = graph->rules[i];
+    for (size_t j = 0; j < _bb_graph_rule_n_inputs(rule); ++j) {
+      node = _bb_graph_rule_input(graph, rule, j);
+      if (node->producer == 0)
+        _bb_watch_add(node->path);
+    }
+  }
+
+  if (own_jobs != NULL)
+    bb_jobs_destroy(&own_jobs);
+  else
+    _bb_jobs_give_back(jobs, first_done, first_job);
+
+  hits = _bb_cache.hits - hits;
+  misses = _bb_cache.misses - misses;
+  if (ran == 0 && failed == 0 && hits == 0)
+    bb_info("Nothing to be done");
+  else
+    bb_info("Ran %zu of %zu rules, %zu failed", ran, n_rules, failed);
+  if (hits + misses > 0)
+    bb_info("Cache: %zu hits, %zu misses (%.0f%% hit rate)",
+            hits, misses, 100.0 * hits / (hits + misses));
+  if (_bb_cache.stored > 0) {
+    evict_start = bb_trace_begin();
+    _bb_cache_update_size();
+    _bb_trace_span("cache", "Evict", 0, evict_start, _bb_time_ns(), NULL);
+  }
+
+  _bb_trace_span("graph", "Build", 0, start, _bb_time_ns(), NULL);
+  return failed;
 }
 
-void bb_cmd_destroy(bb_cmd_t* cmd) {
-  bb_assert(cmd != NULL);
-  bb_assert(*cmd != NULL);
-  bb_string_destroy(&(*cmd)->argv);
-  bb_string_destroy(&(*cmd)->envp);
-  bb_free(cmd);
+void bb_graph_destroy(bb_graph_t* graph) {
+  bb_rule_t rule;
+
+  bb_assert(graph != NULL);
+  bb_assert(*graph != NULL);
+
+  for (size_t i = 0; i < bb_vector_length((*graph)->rules); ++i) {
+    rule = (*graph)->rules[i];
+    bb_cmd_destroy(&rule->recipe);
+    bb_vector_destroy(&rule->inputs);
+    bb_vector_destroy(&rule->outputs);
+    bb_vector_destroy(&rule->discovered);
+    bb_free(&rule);
+  }
+  bb_vector_destroy(&(*graph)->rules);
+  bb_vector_destroy(&(*graph)->nodes);
+  bb_map_destroy(&(*graph)->index);
+  bb_arena_destroy(&(*graph)->arena);
+  bb_free(graph);
 }
 
-static inline unsigned int _bb_vector_compute_checksum(_bb_vector_t vec) {
-  return -(vec->capacity + vec->length + vec->item_size);
+// The checksum catches pointers that are not vectors, and headers that
+// were overwritten. It is checked on every access, so release builds
+// (with NDEBUG) skip it.
+static inline void _bb_vector_update_checksum(_bb_vector_t vec) {
+#ifndef NDEBUG
+  vec->checksum = -(unsigned int)(vec->capacity + vec->length +
+                                  vec->item_size);
+#else
+  BB_UNUSED(vec);
+#endif
 }
 
 static inline void _bb_vector_validate_checksum(_bb_vector_t vec) {
-  bb_assert((vec->item_size + vec->length +
-             vec->capacity + vec->checksum) == 0);
+#ifndef NDEBUG
+  bb_assert((unsigned int)(vec->item_size + vec->length +
+                           vec->capacity + vec->checksum) == 0);
+#else
+  BB_UNUSED(vec);
+#endif
 }
 
 static inline _bb_vector_t _bb_vector_get(void* ptr) {
@@ -938,56 +5816,147 @@ static inline _bb_vector_t _bb_vector_get(void* ptr) {
   return vec;
 }
 
-void* _bb_vector_new(size_t item_size, size_t capacity) {
+static inline void* _bb_vector_at(_bb_vector_t vec, size_t index) {
+  return (char*)(vec + 1) + index * vec->item_size;
+}
+
+// Vectors allocated in an arena are never freed: growing them leaves the
+// old items in the arena, and bb_vector_destroy(..) only forgets about
+// them. If arena is NULL, the heap is used.
+void* _bb_vector_new_in(bb_arena_t arena, size_t item_size,
+                        size_t capacity) {
   _bb_vector_t vec;
+  size_t size;
 
-  bb_assert(item_size > 0);
+  bb_assert(item_size > 0 && item_size <= UINT32_MAX);
 
   if (capacity < BB_VECTOR_MIN_CAPACITY)
     capacity = BB_VECTOR_MIN_CAPACITY;
 
-  vec = bb_malloc(capacity * item_size + sizeof(*vec));
+  bb_assert(capacity <= (SIZE_MAX - sizeof(*vec)) / item_size);
+  size = capacity * item_size + sizeof(*vec);
+  vec = arena != NULL ? bb_arena_alloc(arena, size) : bb_malloc(size);
+  vec->arena = arena;
   vec->item_size = item_size;
   vec->capacity = capacity;
   vec->length = 0;
-  vec->checksum = _bb_vector_compute_checksum(vec);
+  _bb_vector_update_checksum(vec);
 
   return vec + 1;
 }
 
-void* _bb_vector_push(void* vec_ptr, void* elem) {
-  _bb_vector_t vec;
+void* _bb_vector_new(size_t item_size, size_t capacity) {
+  return _bb_vector_new_in(NULL, item_size, capacity);
+}
+
+static _bb_vector_t _bb_vector_resize(_bb_vector_t vec, size_t capacity) {
+  size_t size;
   void* raw_ptr;
 
-  bb_assert(vec_ptr != NULL);
-  vec = _bb_vector_get(vec_ptr);
-  if (vec->length + 1 >= vec->capacity) {
-    bb_assert((vec->capacity >> 31) == 0); // Ensure we don't overflow U32.
-    vec->capacity <<= 1;
-    vec = bb_realloc(vec, vec->capacity * vec->item_size + sizeof(*vec));
-  }
+  bb_assert(capacity <= (SIZE_MAX - sizeof(*vec)) / vec->item_size);
+  size = capacity * vec->item_size + sizeof(*vec);
+  if (vec->arena != NULL) {
+    raw_ptr = bb_arena_alloc(vec->arena, size);
+    memcpy(raw_ptr, vec, vec->length * vec->item_size + sizeof(*vec));
+    vec = raw_ptr;
+  } else
+    vec = bb_realloc(vec, size);
+  vec->capacity = capacity;
+  return vec;
+}
+
+// Make room for at least needed items, growing geometrically so that
+// adding items one by one takes amortized constant time.
+static inline _bb_vector_t _bb_vector_grow(_bb_vector_t vec, size_t needed) {
+  if (needed <= vec->capacity)
+    return vec;
+  return _bb_vector_resize(vec, needed > vec->capacity << 1 ?
+                                needed : vec->capacity << 1);
+}
 
-  raw_ptr = ((char*)vec_ptr) + vec->item_size * vec->length++;
-  memcpy(raw_ptr, elem, vec->item_size);
+// Make room for at least capacity items, so that adding them does not
+// reallocate the vector.
+void* _bb_vector_reserve(void* vec_ptr, size_t capacity) {
+  _bb_vector_t vec = _bb_vector_get(vec_ptr);
+  if (capacity <= vec->capacity)
+    return vec_ptr;
+  vec = _bb_vector_resize(vec, capacity);
+  _bb_vector_update_checksum(vec);
+  return vec + 1;
+}
 
-  vec->checksum = _bb_vector_compute_checksum(vec);
+void* _bb_vector_push(void* vec_ptr, void* elem) {
+  _bb_vector_t vec = _bb_vector_get(vec_ptr);
+  vec = _bb_vector_grow(vec, vec->length + 1);
+  memcpy(_bb_vector_at(vec, vec->length++), elem, vec->item_size);
+  _bb_vector_update_checksum(vec);
   return vec + 1;
 }
 
-long bb_vector_pop(void* vec_ptr, void* elem) {
+// Append count items at once, which must not point into the vector.
+void* _bb_vector_extend(void* vec_ptr, const void* elems, size_t count) {
   _bb_vector_t vec = _bb_vector_get(vec_ptr);
-  unsigned int len;
-  void* raw_ptr;
+  if (count == 0)
+    return vec_ptr;
+  bb_assert(elems != NULL);
+  vec = _bb_vector_grow(vec, vec->length + count);
+  memcpy(_bb_vector_at(vec, vec->length), elems, count * vec->item_size);
+  vec->length += count;
+  _bb_vector_update_checksum(vec);
+  return vec + 1;
+}
 
-  if ((len = vec->length) == 0)
-    goto out;
+// Insert an item before index, moving the following ones up.
+void* _bb_vector_insert(void* vec_ptr, size_t index, void* elem) {
+  _bb_vector_t vec = _bb_vector_get(vec_ptr);
+  bb_assert(index <= vec->length);
+  vec = _bb_vector_grow(vec, vec->length + 1);
+  memmove(_bb_vector_at(vec, index + 1), _bb_vector_at(vec, index),
+          (vec->length - index) * vec->item_size);
+  memcpy(_bb_vector_at(vec, index), elem, vec->item_size);
+  ++vec->length;
+  _bb_vector_update_checksum(vec);
+  return vec + 1;
+}
 
-  raw_ptr = ((char*)vec_ptr) + vec->item_size * --vec->length;
-  memcpy(elem, raw_ptr, vec->item_size);
+// Remove the item at index, moving the following ones down.
+void bb_vector_remove(void* vec_ptr, size_t index) {
+  _bb_vector_t vec = _bb_vector_get(vec_ptr);
+  bb_assert(index < vec->length);
+  --vec->length;
+  memmove(_bb_vector_at(vec, index), _bb_vector_at(vec, index + 1),
+          (vec->length - index) * vec->item_size);
+  _bb_vector_update_checksum(vec);
+}
 
-  vec->checksum = _bb_vector_compute_checksum(vec);
-out:
-  return len - 1;
+// Remove the item at index, replacing it with the last one. Unlike
+// bb_vector_remove(..), this does not keep the order of the items.
+void bb_vector_swap_remove(void* vec_ptr, size_t index) {
+  _bb_vector_t vec = _bb_vector_get(vec_ptr);
+  bb_assert(index < vec->length);
+  if (index != --vec->length)
+    memcpy(_bb_vector_at(vec, index), _bb_vector_at(vec, vec->length),
+           vec->item_size);
+  _bb_vector_update_checksum(vec);
+}
+
+// Remove all the items, keeping the capacity.
+void bb_vector_clear(void* vec_ptr) {
+  _bb_vector_t vec = _bb_vector_get(vec_ptr);
+  vec->length = 0;
+  _bb_vector_update_checksum(vec);
+}
+
+// Returns the new length, or -1 if the vector was empty.
+long bb_vector_pop(void* vec_ptr, void* elem) {
+  _bb_vector_t vec = _bb_vector_get(vec_ptr);
+
+  if (vec->length == 0)
+    return -1;
+
+  memcpy(elem, _bb_vector_at(vec, --vec->length), vec->item_size);
+  _bb_vector_update_checksum(vec);
+  return vec->length;
 }
 
 size_t bb_vector_length(void* vec_ptr) {
@@ -1003,7 +5972,8 @@ void _bb_vector_destroy(void** vec_ptr) {
   bb_assert(vec_ptr != NULL);
   vec = _bb_vector_get(*vec_ptr);
   *vec_ptr = NULL;
-  bb_free(&vec);
+  if (vec->arena == NULL)
+    bb_free(&vec);
 }
 
 typedef struct {
@@ -1013,21 +5983,24 @@ typedef struct {
 } *_bb_params_t;
 
 static _bb_params_t params;
+// Holds the parameters, and the temporaries needed to look them up.
+static bb_arena_t _bb_params_arena;
 
 static const char* _bb_param_get_env_name(const char* long_name) {
   size_t name_len;
   char *env_name, *e;
 
   bb_assert(long_name != NULL);
-  name_len = strlen(long_name) + 3;
+  name_len = strlen(long_name) + 4;
 
-  e = env_name = bb_malloc(name_len);
+  e = env_name = bb_arena_alloc(_bb_params_arena, name_len);
   *(e++) = 'B';
   *(e++) = 'B';
   *(e++) = '_';
 
   for (const char* n = long_name; *n; ++n)
     *(e++) = isalnum(*n) ? toupper(*n) : '_';
+  *e = '\0';
 
   return env_name;
 }
@@ -1038,6 +6011,7 @@ static const char* _bb_params_find_by_name(const char* long_name,
   size_t name_len;
   const char *arg, *env_name, *param_value;
   const char* const* argv;
+  bb_arena_mark_t mark;
 
   bb_assert(params != NULL);
   bb_assert(long_name != NULL);
@@ -1047,18 +6021,22 @@ static const char* _bb_params_find_by_name(const char* long_name,
   while ((arg = *(argv++)) != NULL) {
     if (*(arg++) != '-')
       continue; // Arg. does not start with '-', skip.
-    if (*arg == short_name)
+    if (short_name != '\0' && *arg == short_name)
       break;    // Arg. matches the short name, we found our guy!
     if (*(arg++) != '-')
       continue; // Arg. does not start with '--', skip.
-    if (!strncmp(long_name, arg, name_len))
+    // NOTE: The name must match as a whole, e.g. --cache-size is not
+    //       --cache.
+    if (!strncmp(long_name, arg, name_len) &&
+        (arg[name_len] == '\0' || arg[name_len] == '='))
       break;    // Arg. matches the long name, we found the param!
   }
   if (arg == NULL) {
     // Did not find parameter in argv, search in environment variables.
+    mark = bb_arena_mark(_bb_params_arena);
     env_name = _bb_param_get_env_name(long_name);
     param_value = getenv(env_name);
-    bb_free(&env_name);
+    bb_arena_reset(_bb_params_arena, mark);
     // Always return value as is, if it's an env var.
     return param_value;
   }
@@ -1226,20 +6204,23 @@ static const char** _bb_params_clone_list(char** list) {
   const char** clone;
   size_t i = 0;
   // Count elements in list.
-  while (list[i++])
-    ;
+  while (list[i])
+    ++i;
   // Allocate new list.
-  clone = bb_malloc(sizeof(*clone) * (i + 1));
+  clone = bb_arena_alloc(_bb_params_arena, sizeof(*clone) * (i + 1));
   // Set NULL ptr terminator.
   clone[i] = NULL;
   // Copy over the values.
   for (i = 0; list[i]; ++i)
-    clone[i] = bb_strdup(list[i]);
+    clone[i] = bb_arena_strdup(_bb_params_arena, list[i]);
   return clone;
 }
 
 static _bb_params_t _bb_params_from(int argc, char** argv, char** envp) {
-  _bb_params_t params = bb_malloc(sizeof(*params));
+  _bb_params_t params;
+
+  _bb_params_arena = bb_arena_new(0);
+  params = bb_arena_alloc(_bb_params_arena, sizeof(*params));
 
   params->argc = argc;
   // NOTE: This pointers are weird, because I don't want the user
@@ -1251,12 +6232,223 @@ static _bb_params_t _bb_params_from(int argc, char** argv, char** envp) {
   return params;
 }
 
+#ifdef BB_PLATFORM_LINUX
+// Stat cache entries in directories that are not watched may be stale.
+static void _bb_watch_invalidate_unwatched(void) {
+  _bb_stat_t entry;
+  const char* sep;
+  char* dir;
+
+  for (size_t i = 0; i < bb_vector_length(_bb_stat_cache.entries); ++i) {
+    entry = _bb_stat_cache.entries[i];
+    sep = strrchr(entry->path, '/');
+    if (sep == NULL)
+      dir = bb_strdup(".");
+    else {
+      if (sep == entry->path)
+        ++sep;
+      dir = bb_malloc(sep - entry->path + 1);
+      memcpy(dir, entry->path, sep - entry->path);
+      dir[sep - entry->path] = '\0';
+    }
+    if (bb_map_find_cstr(_bb_watch.dirs, dir) == NULL)
+      entry->valid = BB_FALSE;
+    bb_free(&dir);
+  }
+}
+
+// Wait for a watched file to change, and then for the burst of events
+// that usually follows (e.g. an editor saving many files) to settle.
+// Returns BB_TRUE if BB_SOURCE itself changed.
+static int _bb_watch_wait(void) {
+  char buffer[4096]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event* event;
+  const char* dir;
+  struct pollfd pfd;
+  bb_string_t path, error;
+  int changed = BB_FALSE, source_changed = BB_FALSE, timeout = -1;
+  ssize_t n;
+
+  path = bb_string_default();
+  pfd.fd = _bb_watch.fd;
+  pfd.events = POLLIN;
+  for (;;) {
+    n = poll(&pfd, 1, timeout);
+    if (n == 0)
+      break; // Nothing happened for a while.
+    if (n > 0)
+      n = read(_bb_watch.fd, buffer, sizeof(buffer));
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      error = _bb_strerror();
+      bb_crit("Could not wait for file changes: %s", error->cstr);
+    }
+
+    for (char* ptr = buffer; ptr < buffer + n;
+         ptr += sizeof(*event) + event->len) {
+      event = (const struct inotify_event*)ptr;
+      if (event->mask & IN_Q_OVERFLOW) {
+        // Some events were lost, so anything may have changed.
+        _bb_stat_invalidate(NULL, BB_TRUE);
+        changed = source_changed = BB_TRUE;
+        continue;
+      }
+      if (event->len == 0 || event->wd < 0 ||
+          (size_t)event->wd >= bb_vector_length(_bb_watch.wd_dirs) ||
+          (dir = _bb_watch.wd_dirs[event->wd]) == NULL)
+        continue;
+
+      path->length = 0;
+      path->cstr[0] = '\0';
+      if (strcmp(dir, ".")) {
+        bb_string_concat(path, dir);
+        if (path->cstr[path->length - 1] != '/')
+          bb_string_append(path, '/');
+      }
+      bb_string_concat(path, event->name);
+
+      // NOTE: Every file in a watched directory is kept up to date in the
+      //       stat cache, not only the inputs.
+      _bb_stat_invalidate(path->cstr, BB_TRUE);
+      if (bb_map_find(_bb_watch.paths, path->cstr, path->length) == NULL)
+        continue;
+      changed = BB_TRUE;
+      if (!strcmp(path->cstr, BB_SOURCE))
+        source_changed = BB_TRUE;
+    }
+    if (changed)
+      timeout = BB_WATCH_DEBOUNCE_MS;
+  }
+
+  bb_string_destroy(&path);
+  return source_changed;
+}
+#endif
+
+// Run bb_main(..) again every time one of the inputs of the build changes.
+// The stat cache is kept across runs, so only the changed files are
+// looked at again. If BB_SOURCE changes, bb is rebuilt and restarted.
+static int _bb_watch_run(char** argv, size_t usage_top) {
+#ifndef BB_PLATFORM_LINUX
+  BB_UNIMPLEMENTED_STUB();
+#else
+  bb_string_t error;
+  int rc;
+
+  _bb_watch.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (_bb_watch.fd < 0) {
+    error = _bb_strerror();
+    bb_crit("Could not watch for file changes: %s", error->cstr);
+  }
+  _bb_watch.active = BB_TRUE;
+  _bb_watch.paths = _bb_map_new(0);
+  _bb_watch.dirs = bb_map_new(int);
+  _bb_watch.wd_dirs = bb_vector_default(char*);
+  _bb_watch.strings = bb_vector_default(char*);
+  _bb_watch_add(BB_SOURCE);
+
+  for (;;) {
+    rc = bb_main();
+    if (rc != 0)
+      bb_error("Build failed with exit code %d", rc);
+    bb_usage_summary_print(usage_top);
+    bb_usage_summary_reset();
+    bb_trace_write();
+    _bb_touch_self(argv[0]);
+    bb_info("Watching %zu files for changes...", bb_map_length(_bb_watch.paths));
+
+    if (_bb_watch_wait()) {
+      bb_info("%s changed, restarting", BB_SOURCE);
+      bb_trace_write();
+      _bb_jobserver_close();
+      // NOTE: The new process rebuilds bb, if needed, before starting.
+      execv(argv[0], argv);
+      error = _bb_strerror();
+      bb_crit("Could not restart %s: %s", argv[0], error->cstr);
+    }
+    _bb_watch_invalidate_unwatched();
+  }
+#endif
+}
+
 int main(int argc, char** argv, char** envp) {
+  const long default_cache_size = BB_CACHE_MAX_SIZE >> 20;
+  const long default_usage_top = BB_USAGE_TOP, no_limit = 0;
+  const char *cache_dir, *trace_path;
+  uint64_t rebuilt, parsed;
+  long cache_size, usage_top, memory_budget, max_jobs;
   int rc;
   bb_assert(argc >= 1);
+#ifdef BB_ALLOC_STATS
+  atexit(bb_alloc_stats_print);
+#endif
+  // NOTE: The trace is only enabled once the parameters are parsed, so
+  //       the phases before that are recorded afterwards.
+  _bb_trace.epoch = _bb_time_ns();
   _bb_rebuild_if_needed(argv);
+  rebuilt = _bb_time_ns();
   params = _bb_params_from(argc, argv, envp);
+  parsed = _bb_time_ns();
+  trace_path = bb_params_get_string("trace", '\0',
+                                    "Write a trace of the build, in Chrome "
+                                    "trace event format, to this file.", "");
+  if (*trace_path != '\0') {
+    bb_trace_enable(trace_path);
+    _bb_trace_span("bb", "Rebuild check", 0, _bb_trace.epoch, rebuilt, NULL);
+    _bb_trace_span("bb", "Parse parameters", 0, rebuilt, parsed, NULL);
+  }
+  cache_dir = bb_params_get_string("cache", '\0',
+                                   "Directory of the compilation cache, "
+                                   "which is disabled if empty.", "");
+  if (*cache_dir != '\0') {
+    cache_size = bb_params_get_int("cache-size", '\0',
+                                   "Size limit of the compilation cache, "
+                                   "in MiB.", &default_cache_size);
+    if (cache_size <= 0)
+      bb_crit("The size of the compilation cache must be positive");
+    bb_cache_enable(cache_dir, (uint64_t)cache_size << 20,
+                    bb_params_get_switch("cache-hardlink", '\0',
+                                         "Link outputs to the compilation "
+                                         "cache, instead of copying them.",
+                                         BB_FALSE));
+  }
+  memory_budget = bb_params_get_int("memory-budget", '\0',
+                                    "Limit on the memory expected to be "
+                                    "used by the jobs running at once, in "
+                                    "MiB, or 0 for no limit.", &no_limit);
+  if (memory_budget < 0)
+    bb_crit("The memory budget must not be negative");
+  _bb_jobs_defaults.memory_budget = (uint64_t)memory_budget << 20;
+  _bb_jobs_defaults.watch_pressure =
+    bb_params_get_switch("memory-pressure", '\0',
+                         "Start no more jobs while the system is short on "
+                         "memory.", BB_FALSE);
+  max_jobs = bb_params_get_int("jobs", 'j',
+                               "Number of jobs to run at once, or 0 for one "
+                               "per CPU.", &no_limit);
+  if (max_jobs < 0)
+    bb_crit("The number of jobs must not be negative");
+  _bb_jobs_defaults.max_jobs = max_jobs;
+  // NOTE: make only understands fifo jobservers since 4.4.
+  _bb_jobserver_setup(bb_params_get_string("jobserver", '\0',
+                                           "Jobserver to serve to the "
+                                           "builds we run: pipe or fifo. "
+                                           "Under make, its jobserver is "
+                                           "used instead, unless this is "
+                                           "none.", "auto"),
+                      max_jobs > 0 ? (size_t)max_jobs : bb_cpu_count());
+  usage_top = bb_params_get_int("usage-top", '\0',
+                                "Number of most expensive commands to list "
+                                "after the build.", &default_usage_top);
+  if (usage_top < 0)
+    usage_top = 0;
+  if (bb_params_get_switch("watch", '\0',
+                           "Rebuild every time an input changes.", BB_FALSE))
+    return _bb_watch_run(argv, usage_top);
   rc = bb_main();
+  bb_usage_summary_print(usage_top);
   _bb_touch_self(argv[0]);
   return rc;
 }
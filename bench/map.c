@@ -0,0 +1,81 @@
+// Compares lookups in a bb_map_t with a linear search of the keys, for
+// path-like keys. Run from the repository root:
+//   cc -O2 -o bench/map -pthread bench/map.c && bench/map
+#define BB_SOURCE "bench/map.c"
+#define BB_REBUILD_ARGS "-O2", "-o", "bench/map", "-pthread", BB_SOURCE
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+#include <time.h>
+
+#define LOOKUPS 20000
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int bb_main(void) {
+  static const size_t sizes[] = {100, 1000, 10000, 100000};
+  volatile size_t found = 0;
+  char key[64];
+  char** keys;
+  bb_map_t map;
+  double start, insert, hits, misses, linear;
+  size_t n;
+
+  printf("%8s %12s %12s %12s %12s\n", "keys", "insert/key",
+         "map hit", "map miss", "linear hit");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s) {
+    n = sizes[s];
+    keys = bb_malloc(n * sizeof(*keys));
+    for (size_t i = 0; i < n; ++i) {
+      snprintf(key, sizeof(key), "out/obj/src/module%zu/file%zu.o",
+               i % 97, i);
+      keys[i] = bb_strdup(key);
+    }
+
+    map = bb_map_new(size_t);
+    start = now_ns();
+    for (size_t i = 0; i < n; ++i)
+      bb_map_insert_cstr(map, keys[i], &i);
+    insert = (now_ns() - start) / n;
+
+    start = now_ns();
+    for (size_t i = 0; i < LOOKUPS; ++i)
+      found += bb_map_find_cstr(map, keys[i * 7919 % n]) != NULL;
+    hits = (now_ns() - start) / LOOKUPS;
+
+    // Same length and prefix as the keys, but never in the map.
+    start = now_ns();
+    for (size_t i = 0; i < LOOKUPS; ++i) {
+      keys[i % n][0] = 'X';
+      found += bb_map_find_cstr(map, keys[i % n]) != NULL;
+      keys[i % n][0] = 'o';
+    }
+    misses = (now_ns() - start) / LOOKUPS;
+
+    // NOTE: This is measured, with as many lookups as the map, so it's
+    //       slow for the largest sizes.
+    start = now_ns();
+    for (size_t i = 0; i < LOOKUPS; ++i) {
+      const char* wanted = keys[i * 7919 % n];
+      for (size_t j = 0; j < n; ++j) {
+        if (!strcmp(keys[j], wanted)) {
+          ++found;
+          break;
+        }
+      }
+    }
+    linear = (now_ns() - start) / LOOKUPS;
+
+    printf("%8zu %9.1f ns %9.1f ns %9.1f ns %9.1f ns\n",
+           n, insert, hits, misses, linear);
+    bb_map_destroy(&map);
+    for (size_t i = 0; i < n; ++i)
+      bb_free(&keys[i]);
+    bb_free(&keys);
+  }
+  return 0;
+}
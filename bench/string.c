@@ -0,0 +1,62 @@
+// Checks that building a string piece by piece takes linear time, i.e.
+// that the time per byte and the number of reallocations per doubling of
+// the length stay constant. Run from the repository root:
+//   cc -O2 -o bench/string -pthread bench/string.c && bench/string
+#define BB_SOURCE "bench/string.c"
+#define BB_REBUILD_ARGS "-O2", "-o", "bench/string", "-pthread", BB_SOURCE
+#define BB_ALLOC_STATS
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+#include <time.h>
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Grow two strings in lockstep, so that realloc(..) cannot simply extend
+// the last block, with one of append, concat or appendf.
+static void grow(const char* how, size_t length) {
+  bb_alloc_stats_t before, after;
+  bb_string_t a, b;
+  double start, elapsed;
+
+  a = bb_string_default();
+  b = bb_string_default();
+  bb_alloc_stats(&before);
+  start = now_ns();
+  while (a->length < length) {
+    if (!strcmp(how, "append")) {
+      bb_string_append(a, 'a');
+      bb_string_append(b, 'b');
+    } else if (!strcmp(how, "concat")) {
+      bb_string_concat(a, "abcdefgh");
+      bb_string_concat(b, "abcdefgh");
+    } else {
+      bb_string_appendf(a, "%zu,", a->length);
+      bb_string_appendf(b, "%zu,", b->length);
+    }
+  }
+  elapsed = now_ns() - start;
+  bb_alloc_stats(&after);
+
+  printf("%-8s %10zu %11.2f ms %11.2f ns %10zu\n", how, length,
+         elapsed / 1e6, elapsed / (2 * a->length),
+         after.reallocs - before.reallocs);
+  bb_string_destroy(&a);
+  bb_string_destroy(&b);
+}
+
+int bb_main(void) {
+  static const char* hows[] = {"append", "concat", "appendf"};
+
+  printf("%-8s %10s %14s %14s %10s\n", "", "bytes", "total",
+         "per byte", "reallocs");
+  for (size_t h = 0; h < sizeof(hows) / sizeof(*hows); ++h) {
+    for (size_t length = 1 << 16; length <= 1 << 24; length <<= 2)
+      grow(hows[h], length);
+  }
+  return 0;
+}
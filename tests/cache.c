@@ -0,0 +1,89 @@
+// Checks that compile rules are found in the compilation cache when their
+// preprocessed input did not change, and only then. Run from the
+// repository root:
+//   cc -o tests/cache -pthread tests/cache.c && tests/cache
+#define BB_SOURCE "tests/cache.c"
+#define BB_REBUILD_ARGS "-o", "tests/cache", "-pthread", BB_SOURCE
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+#define DIR ".bb/tests/cache/"
+
+static void build(void) {
+  bb_graph_t graph;
+  bb_rule_t rule;
+  bb_cmd_t cmd;
+
+  graph = bb_graph_new();
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, BB_DEFAULT_CC, "-c", DIR "a.c", "-o", DIR "a.o",
+                     "-MMD", "-MF", DIR "a.d");
+  rule = bb_graph_add_rule(graph, &cmd);
+  bb_graph_add_inputs(graph, rule, DIR "a.c");
+  bb_graph_add_outputs(graph, rule, DIR "a.o");
+  bb_graph_set_depfile(graph, rule, DIR "a.d");
+  bb_assert(bb_graph_build(graph, NULL) == 0);
+  bb_graph_destroy(&graph);
+}
+
+// Check the hits and misses of the cache since the last call.
+static void check_stats(size_t hits, size_t misses) {
+  static size_t last_hits, last_misses;
+  size_t now_hits, now_misses;
+
+  bb_cache_stats(&now_hits, &now_misses);
+  bb_assert(now_hits - last_hits == hits);
+  bb_assert(now_misses - last_misses == misses);
+  last_hits = now_hits;
+  last_misses = now_misses;
+}
+
+static void write_source(const char* source) {
+  bb_file_write(DIR "a.c", source, strlen(source));
+}
+
+int bb_main(void) {
+  size_t size, size2;
+  char *object, *object2;
+  struct stat info;
+
+  bb_file_makedirs(DIR, BB_TRUE);
+  bb_cache_enable(DIR "cache", 0, BB_FALSE);
+  write_source("int a(void) { return 1; }\n");
+
+  build();
+  check_stats(0, 1);
+  object = bb_file_read_sized(DIR "a.o", &size);
+
+  // Up to date, the cache is not even looked at.
+  build();
+  check_stats(0, 0);
+
+  // The outputs are restored from the cache.
+  bb_file_delete(DIR "a.o");
+  bb_file_delete(DIR "a.d");
+  build();
+  check_stats(1, 0);
+  object2 = bb_file_read_sized(DIR "a.o", &size2);
+  bb_assert(size == size2 && !memcmp(object, object2, size));
+  bb_file_free((void**)&object2);
+  bb_assert(stat(DIR "a.d", &info) == 0);
+
+  // A comment does not change the preprocessed input.
+  // NOTE: Adding a line would change the line markers.
+  write_source("int a(void) { return 1; } // One.\n");
+  build();
+  check_stats(1, 0);
+
+  write_source("int a(void) { return 2; }\n");
+  build();
+  check_stats(0, 1);
+  object2 = bb_file_read_sized(DIR "a.o", &size2);
+  bb_assert(size != size2 || memcmp(object, object2, size));
+  bb_file_free((void**)&object2);
+  bb_file_free((void**)&object);
+
+  bb_file_delete(".bb/tests");
+  bb_info("All tests passed");
+  return 0;
+}
@@ -0,0 +1,34 @@
+// Checks that a command which cannot be run fails with status 127, on its
+// own or in a job queue, instead of stopping the build. Run from the
+// repository root:
+//   cc -o tests/cmd_missing -pthread tests/cmd_missing.c && tests/cmd_missing
+#define BB_SOURCE "tests/cmd_missing.c"
+#define BB_REBUILD_ARGS "-o", "tests/cmd_missing", "-pthread", BB_SOURCE
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+int bb_main(void) {
+  bb_jobs_t jobs;
+  bb_job_t job;
+  bb_cmd_t cmd;
+
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, "bb-no-such-command", "--version");
+  bb_assert(bb_cmd_run(cmd) == 127);
+  bb_cmd_destroy(&cmd);
+
+  jobs = bb_jobs_new(2);
+  cmd = bb_cmd_new();
+  bb_cmd_set_capture(cmd, BB_TRUE);
+  bb_cmd_append_args(cmd, "bb-no-such-command");
+  job = bb_jobs_submit(jobs, &cmd);
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, "true");
+  bb_jobs_submit(jobs, &cmd);
+  bb_assert(bb_jobs_wait_all(jobs) == 1);
+  bb_assert(job->exit_status == 127);
+  bb_jobs_destroy(&jobs);
+
+  bb_info("All tests passed");
+  return 0;
+}
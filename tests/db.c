@@ -0,0 +1,92 @@
+// Checks that the records of the build database are found again after it's
+// written, that updates replace them, and that a corrupt database is
+// ignored. Run from the repository root:
+//   cc -o tests/db -pthread tests/db.c && tests/db
+#define BB_SOURCE "tests/db.c"
+#define BB_REBUILD_ARGS "-o", "tests/db", "-pthread", BB_SOURCE
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+#define DB ".bb/tests/db/db"
+#define N 100
+
+// The record of key i, of i + 1 bytes, as written the given time.
+static void record_of(size_t i, int time, char* blob) {
+  for (size_t j = 0; j <= i; ++j)
+    blob[j] = 'a' + (i + j + time) % 26;
+}
+
+// Check that key i has the record written the given time.
+static void check(_bb_db_t db, size_t i, int time) {
+  char expected[N];
+  const char* blob;
+  size_t size;
+
+  record_of(i, time, expected);
+  blob = _bb_db_get(db, _bb_hash(&i, sizeof(i), 0), &size);
+  bb_assert(blob != NULL);
+  bb_assert(((uintptr_t)blob & 7) == 0);
+  bb_assert(size == i + 1);
+  bb_assert(!memcmp(blob, expected, size));
+}
+
+static void put(_bb_db_t db, size_t i, int time) {
+  char blob[N];
+  record_of(i, time, blob);
+  _bb_db_put(db, _bb_hash(&i, sizeof(i), 0), blob, i + 1);
+}
+
+int bb_main(void) {
+  size_t size, size2, missing = N;
+  char *data, *data2;
+  _bb_db_t db;
+
+  bb_file_makedirs(".bb/tests/db", BB_TRUE);
+  db = _bb_db_open(DB);
+  bb_assert(_bb_db_get(db, 1, &size) == NULL);
+  for (size_t i = 0; i < N; ++i)
+    put(db, i, 0);
+  // The last update of a key wins.
+  put(db, 5, 1);
+  _bb_db_close(&db);
+
+  db = _bb_db_open(DB);
+  for (size_t i = 0; i < N; ++i)
+    check(db, i, i == 5);
+  bb_assert(_bb_db_get(db, _bb_hash(&missing, sizeof(missing), 0),
+                       &size) == NULL);
+  // Records which are not updated are kept.
+  for (size_t i = 0; i < N; i += 2)
+    put(db, i, 2);
+  _bb_db_close(&db);
+
+  db = _bb_db_open(DB);
+  for (size_t i = 0; i < N; ++i)
+    check(db, i, i & 1 ? i == 5 : 2);
+  _bb_db_close(&db);
+
+  // The file only depends on the records, not on how they were written.
+  data = bb_file_read_sized(DB, &size);
+  db = _bb_db_open(DB);
+  put(db, 3, 0);
+  _bb_db_close(&db);
+  data2 = bb_file_read_sized(DB, &size2);
+  bb_assert(size == size2);
+  bb_assert(!memcmp(data, data2, size));
+  bb_file_free((void**)&data);
+  bb_file_free((void**)&data2);
+
+  bb_file_write(DB, "BBDB garbage", 12);
+  db = _bb_db_open(DB);
+  bb_assert(db->count == 0);
+  put(db, 0, 0);
+  _bb_db_close(&db);
+  db = _bb_db_open(DB);
+  check(db, 0, 0);
+  bb_assert(db->count == 1);
+  _bb_db_close(&db);
+
+  bb_file_delete(".bb/tests");
+  bb_info("All tests passed");
+  return 0;
+}
@@ -0,0 +1,53 @@
+// Checks that the prerequisites of depfiles are found with their escapes
+// and across continued lines. Run from the repository root:
+//   cc -o tests/depfile -pthread tests/depfile.c && tests/depfile
+#define BB_SOURCE "tests/depfile.c"
+#define BB_REBUILD_ARGS "-o", "tests/depfile", "-pthread", BB_SOURCE
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+// Check that data lists the prerequisites given after it, up to NULL.
+static void check(const char* data, ...) {
+  const char *expected, *found;
+  bb_string_t deps;
+  size_t count, n = 0;
+  va_list ap;
+
+  deps = bb_string_default();
+  count = _bb_depfile_parse(data, strlen(data), deps);
+  found = deps->cstr;
+  va_start(ap, data);
+  while ((expected = va_arg(ap, const char*)) != NULL) {
+    bb_assert(n < count);
+    bb_assert(!strcmp(found, expected));
+    found += strlen(found) + 1;
+    ++n;
+  }
+  va_end(ap);
+  bb_assert(n == count);
+  bb_assert(found == deps->cstr + deps->length);
+  bb_string_destroy(&deps);
+}
+
+int bb_main(void) {
+  check("out.o: a.c b.h\n", "a.c", "b.h", NULL);
+  check("out.o: a.c", "a.c", NULL);
+  check("out.o:\n", NULL);
+
+  // Continued lines, also with CRLF.
+  check("out.o: a.c \\\n  b.h \\\n  c.h\n", "a.c", "b.h", "c.h", NULL);
+  check("out.o: a.c \\\r\n  b.h\r\n", "a.c", "b.h", NULL);
+  check("out.o \\\n  out.d: a.c\n", "a.c", NULL);
+
+  // Escapes.
+  check("out.o: my\\ file.h\n", "my file.h", NULL);
+  check("out.o: a\\#b.h a$$b.h\n", "a#b.h", "a$b.h", NULL);
+  check("out.o: C:\\include\\c.h\n", "C:\\include\\c.h", NULL);
+
+  // Phony targets of -MP have no prerequisites.
+  check("out.o: a.c b.h\n\nb.h:\n", "a.c", "b.h", NULL);
+  check("out.o: a.c\nout2.o: b.c\n", "a.c", "b.c", NULL);
+
+  bb_info("All tests passed");
+  return 0;
+}
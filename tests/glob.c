@@ -0,0 +1,78 @@
+// Checks that glob patterns, and "**" in particular, match the paths they
+// should, and that bb_file_glob(..) finds them on disk. Run from the
+// repository root:
+//   cc -o tests/glob -pthread tests/glob.c && tests/glob
+#define BB_SOURCE "tests/glob.c"
+#define BB_REBUILD_ARGS "-o", "tests/glob", "-pthread", BB_SOURCE
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+#define DIR ".bb/tests/glob/"
+
+// Check that pattern finds the paths given after it, up to NULL, in order.
+static void check_glob(const char* pattern, ...) {
+  const char* expected;
+  bb_file_list_t list;
+  size_t n = 0;
+  va_list ap;
+
+  list = bb_file_glob(pattern);
+  va_start(ap, pattern);
+  while ((expected = va_arg(ap, const char*)) != NULL) {
+    bb_assert(n < list->count);
+    bb_assert(!strcmp(list->paths[n], expected));
+    ++n;
+  }
+  va_end(ap);
+  bb_assert(n == list->count);
+  bb_file_list_destroy(&list);
+}
+
+int bb_main(void) {
+  bb_assert(bb_glob_match("*.c", "a.c"));
+  bb_assert(!bb_glob_match("*.c", "src/a.c"));
+  bb_assert(!bb_glob_match("*.c", ".a.c"));
+  bb_assert(bb_glob_match("src/?.[ch]", "src/a.h"));
+  bb_assert(!bb_glob_match("src/?.[!ch]", "src/a.h"));
+  bb_assert(bb_glob_match("src/[a-c]*", "src/bar"));
+  bb_assert(bb_glob_match("a\\*", "a*"));
+  bb_assert(!bb_glob_match("a\\*", "ab"));
+
+  // "**" matches any number of directories, even none, but not hidden
+  // ones.
+  bb_assert(bb_glob_match("src/**/*.c", "src/a.c"));
+  bb_assert(bb_glob_match("src/**/*.c", "src/x/a.c"));
+  bb_assert(bb_glob_match("src/**/*.c", "src/x/y/z/a.c"));
+  bb_assert(!bb_glob_match("src/**/*.c", "src/x/a.h"));
+  bb_assert(!bb_glob_match("src/**/*.c", "src/.git/a.c"));
+  bb_assert(!bb_glob_match("src/**/*.c", "lib/src/a.c"));
+  bb_assert(bb_glob_match("**/*.c", "a.c"));
+  bb_assert(bb_glob_match("**/*.c", "src/x/a.c"));
+  bb_assert(bb_glob_match("src/**", "src/x/a.c"));
+  bb_assert(bb_glob_match("src/**/x/*.c", "src/x/a.c"));
+  bb_assert(bb_glob_match("src/**/x/*.c", "src/y/x/a.c"));
+  bb_assert(!bb_glob_match("src/**/x/*.c", "src/y/a.c"));
+  // NOTE: Only a whole component is "**", otherwise it's a '*'.
+  bb_assert(!bb_glob_match("src/a**.c", "src/a/b.c"));
+
+  bb_file_makedirs(DIR "src/x/y", BB_TRUE);
+  bb_file_makedirs(DIR "src/.git", BB_TRUE);
+  bb_file_write(DIR "src/a.c", "a", 1);
+  bb_file_write(DIR "src/a.h", "a", 1);
+  bb_file_write(DIR "src/x/b.c", "b", 1);
+  bb_file_write(DIR "src/x/y/c.c", "c", 1);
+  bb_file_write(DIR "src/.git/d.c", "d", 1);
+
+  check_glob(DIR "src/**/*.c", DIR "src/a.c", DIR "src/x/b.c",
+             DIR "src/x/y/c.c", NULL);
+  check_glob(DIR "src/*.c", DIR "src/a.c", NULL);
+  check_glob(DIR "src/*/*.c", DIR "src/x/b.c", NULL);
+  check_glob(DIR "src/.git/*.c", DIR "src/.git/d.c", NULL);
+  check_glob(DIR "src/a.h", DIR "src/a.h", NULL);
+  check_glob(DIR "src/b.h", NULL);
+  check_glob(DIR "none/**/*.c", NULL);
+
+  bb_file_delete(".bb/tests");
+  bb_info("All tests passed");
+  return 0;
+}
@@ -0,0 +1,118 @@
+// Checks that graphs only rebuild what changed, that headers generated by
+// another rule are written before the rules that include them run, and
+// that jobs of the caller on the same queue are left to it. Run from the
+// repository root:
+//   cc -o tests/graph -pthread tests/graph.c && tests/graph
+#define BB_SOURCE "tests/graph.c"
+#define BB_REBUILD_ARGS "-o", "tests/graph", "-pthread", BB_SOURCE
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+#define DIR ".bb/tests/graph/"
+
+// The number of times the copy rule ran, one line per run after the
+// first.
+static size_t copies(void) {
+  size_t size;
+  char* runs = bb_file_read_sized(DIR "copies", &size);
+  bb_file_free((void**)&runs);
+  return size - 1;
+}
+
+static size_t build(bb_jobs_t jobs) {
+  bb_graph_t graph;
+  bb_rule_t rule;
+  bb_cmd_t cmd;
+  size_t failed;
+
+  graph = bb_graph_new();
+
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, "sh", "-c",
+                     "cp " DIR "in " DIR "out && echo >> " DIR "copies");
+  rule = bb_graph_add_rule(graph, &cmd);
+  bb_graph_add_inputs(graph, rule, DIR "in");
+  bb_graph_add_outputs(graph, rule, DIR "out");
+
+  // NOTE: The header is only found through the depfile, and written
+  //       slowly, so that it's read too early unless the rule waits.
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, "sh", "-c",
+                     "sleep 0.2 && cp " DIR "gen.in " DIR "gen.h");
+  rule = bb_graph_add_rule(graph, &cmd);
+  bb_graph_add_inputs(graph, rule, DIR "gen.in");
+  bb_graph_add_outputs(graph, rule, DIR "gen.h");
+
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, "sh", "-c",
+                     "cp " DIR "gen.h " DIR "use.out && "
+                     "echo '" DIR "use.out: " DIR "use.c \\\\' > "
+                     DIR "use.d && "
+                     "echo ' " DIR "gen.h' >> " DIR "use.d");
+  rule = bb_graph_add_rule(graph, &cmd);
+  bb_graph_add_inputs(graph, rule, DIR "use.c");
+  bb_graph_add_outputs(graph, rule, DIR "use.out");
+  bb_graph_set_depfile(graph, rule, DIR "use.d");
+
+  failed = bb_graph_build(graph, jobs);
+  bb_graph_destroy(&graph);
+  return failed;
+}
+
+static void check_file(const char* path, const char* contents) {
+  char* data = bb_file_read(path);
+  bb_assert(!strcmp(data, contents));
+  bb_file_free((void**)&data);
+}
+
+int bb_main(void) {
+  bb_jobs_t jobs;
+  bb_job_t job, theirs;
+  bb_cmd_t cmd;
+
+  bb_file_makedirs(DIR, BB_TRUE);
+  bb_file_write(DIR "in", "1", 1);
+  bb_file_write(DIR "copies", "\n", 1);
+  bb_file_write(DIR "gen.in", "1", 1);
+  bb_file_write(DIR "gen.h", "1", 1);
+  bb_file_write(DIR "use.c", "\n", 1);
+  jobs = bb_jobs_new(4);
+
+  bb_assert(build(jobs) == 0);
+  bb_assert(copies() == 1);
+  check_file(DIR "out", "1");
+  check_file(DIR "use.out", "1");
+
+  // Nothing changed.
+  bb_assert(build(jobs) == 0);
+  bb_assert(copies() == 1);
+
+  // Only the modification time changed.
+  bb_file_write(DIR "in", "1", 1);
+  bb_assert(build(jobs) == 0);
+  bb_assert(copies() == 1);
+
+  bb_file_write(DIR "in", "2", 1);
+  bb_file_write(DIR "gen.in", "2", 1);
+  bb_assert(build(jobs) == 0);
+  bb_assert(copies() == 2);
+  check_file(DIR "out", "2");
+  check_file(DIR "use.out", "2");
+
+  // A job of the caller, which finishes while the graph is built.
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, "sh", "-c", "exit 5");
+  theirs = bb_jobs_submit(jobs, &cmd);
+  bb_file_write(DIR "in", "3", 1);
+  bb_assert(build(jobs) == 0);
+  bb_assert(copies() == 3);
+  job = bb_jobs_wait_any(jobs);
+  bb_assert(job == theirs);
+  bb_assert(job->exit_status == 5);
+  bb_assert(bb_jobs_wait_any(jobs) == NULL);
+  bb_jobs_destroy(&jobs);
+
+  bb_file_delete(".bb/tests");
+  bb_info("All tests passed");
+  return 0;
+}
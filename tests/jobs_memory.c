@@ -0,0 +1,55 @@
+// Checks that job queues keep to their memory budget, even after a job
+// bigger than the budget was started on its own. Run from the repository
+// root:
+//   cc -o tests/jobs_memory -pthread tests/jobs_memory.c && tests/jobs_memory
+#define BB_SOURCE "tests/jobs_memory.c"
+#define BB_REBUILD_ARGS "-o", "tests/jobs_memory", "-pthread", BB_SOURCE
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+static bb_job_t submit(bb_jobs_t jobs, const char* seconds, uint64_t memory) {
+  bb_cmd_t cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, "sleep", seconds);
+  bb_cmd_set_memory(cmd, memory);
+  return bb_jobs_submit(jobs, &cmd);
+}
+
+static uint64_t end_time(bb_job_t job) {
+  return job->start_time + job->usage.wall_ns;
+}
+
+int bb_main(void) {
+  bb_jobs_t jobs;
+  bb_job_t big, small[3], sized[2];
+
+  jobs = bb_jobs_new(4);
+  bb_jobs_set_memory_limit(jobs, (uint64_t)300 << 20, BB_FALSE);
+
+  // The big job starts on its own, and nothing may run next to it.
+  big = submit(jobs, "0.3", (uint64_t)2 << 30);
+  for (size_t i = 0; i < 3; ++i)
+    small[i] = submit(jobs, "0.1", (uint64_t)10 << 20);
+  // Jobs of unknown size do not fit either, while it runs.
+  submit(jobs, "0.1", 0);
+  bb_jobs_wait_all(jobs);
+  for (size_t i = 0; i < bb_vector_length(jobs->jobs); ++i) {
+    if (jobs->jobs[i] != big)
+      bb_assert(jobs->jobs[i]->start_time >= end_time(big));
+  }
+  bb_assert(jobs->memory_used == 0);
+
+  // Two 200 MiB jobs do not fit together, the small ones fit next to one.
+  sized[0] = submit(jobs, "0.2", (uint64_t)200 << 20);
+  sized[1] = submit(jobs, "0.2", (uint64_t)200 << 20);
+  for (size_t i = 0; i < 3; ++i)
+    small[i] = submit(jobs, "0.1", (uint64_t)10 << 20);
+  bb_jobs_wait_all(jobs);
+  bb_assert(sized[1]->start_time >= end_time(sized[0]));
+  for (size_t i = 0; i < 3; ++i)
+    bb_assert(small[i]->start_time < end_time(sized[0]));
+  bb_assert(jobs->memory_used == 0);
+
+  bb_jobs_destroy(&jobs);
+  bb_info("All tests passed");
+  return 0;
+}
@@ -0,0 +1,50 @@
+// Checks that jobs, and commands run by bb_cmd_run(..), are reaped as soon
+// as they exit, even if a grandchild keeps their captured output open, and
+// that processes which are not jobs are left to their owner. Run from the repository root:
+//   cc -o tests/jobs_reap -pthread tests/jobs_reap.c && tests/jobs_reap
+#define BB_SOURCE "tests/jobs_reap.c"
+#define BB_REBUILD_ARGS "-o", "tests/jobs_reap", "-pthread", BB_SOURCE
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+int bb_main(void) {
+  bb_jobs_t jobs;
+  bb_job_t job;
+  bb_cmd_t cmd;
+  bb_proc_t proc;
+  time_t start;
+
+  jobs = bb_jobs_new(2);
+  start = time(NULL);
+  cmd = bb_cmd_new();
+  bb_cmd_set_capture(cmd, BB_TRUE);
+  bb_cmd_append_args(cmd, "sh", "-c", "sleep 3 & echo captured");
+  bb_jobs_submit(jobs, &cmd);
+  job = bb_jobs_wait_any(jobs);
+  bb_assert(job->exit_status == 0);
+  bb_assert(!strcmp(job->cmd->out->cstr, "captured\n"));
+  bb_assert(time(NULL) - start < 2);
+
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, "sh", "-c", "exit 3");
+  proc = bb_cmd_run_async(cmd);
+  bb_cmd_destroy(&cmd);
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, "sleep", "0.2");
+  bb_jobs_submit(jobs, &cmd);
+  bb_assert(bb_jobs_wait_all(jobs) == 0);
+  bb_assert(bb_cmd_wait(proc) == 3);
+  bb_jobs_destroy(&jobs);
+
+  start = time(NULL);
+  cmd = bb_cmd_new();
+  bb_cmd_set_capture(cmd, BB_TRUE);
+  bb_cmd_append_args(cmd, "sh", "-c", "sleep 3 & echo captured");
+  bb_assert(bb_cmd_run(cmd) == 0);
+  bb_assert(!strcmp(cmd->out->cstr, "captured\n"));
+  bb_assert(time(NULL) - start < 2);
+  bb_cmd_destroy(&cmd);
+
+  bb_info("All tests passed");
+  return 0;
+}
@@ -0,0 +1,56 @@
+// Checks that files written by jobs are not seen with their old
+// modification times, through the stat cache, and that what is known about
+// files outside the working directory survives the commands. Run from the
+// repository root:
+//   cc -o tests/jobs_stat_cache -pthread tests/jobs_stat_cache.c &&
+//   tests/jobs_stat_cache
+#define BB_SOURCE "tests/jobs_stat_cache.c"
+#define BB_REBUILD_ARGS "-o", "tests/jobs_stat_cache", "-pthread", BB_SOURCE
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+int bb_main(void) {
+  char cwd[4096], a[4096 + 16];
+  size_t hits, misses, hits2, misses2;
+  bb_jobs_t jobs;
+  bb_cmd_t cmd;
+
+  bb_file_makedirs(".bb/tests", BB_TRUE);
+  bb_file_write(".bb/tests/a", "a", 1);
+  bb_file_write(".bb/tests/b", "b", 1);
+  bb_assert(bb_file_cmpmodtime(".bb/tests/a", ".bb/tests/b") <= 0);
+
+  jobs = bb_jobs_new(0);
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, "sh", "-c", "sleep 0.05 && touch .bb/tests/a");
+  bb_jobs_submit(jobs, &cmd);
+  bb_jobs_wait_all(jobs);
+  bb_jobs_destroy(&jobs);
+  bb_assert(bb_file_cmpmodtime(".bb/tests/a", ".bb/tests/b") > 0);
+
+  // Also when it's known by its absolute path.
+  bb_assert(getcwd(cwd, sizeof(cwd)) != NULL);
+  snprintf(a, sizeof(a), "%s/.bb/tests/a", cwd);
+  bb_assert(bb_file_cmpmodtime(a, ".bb/tests/b") > 0);
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, "sh", "-c", "sleep 0.05 && touch .bb/tests/b");
+  bb_assert(bb_cmd_run(cmd) == 0);
+  bb_cmd_destroy(&cmd);
+  bb_assert(bb_file_cmpmodtime(a, ".bb/tests/b") < 0);
+
+  // An unrelated command does not write outside the working directory.
+  bb_file_cmpmodtime("/", "/bin/sh");
+  bb_file_cache_stats(&hits, &misses);
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, "true");
+  bb_assert(bb_cmd_run(cmd) == 0);
+  bb_cmd_destroy(&cmd);
+  bb_file_cmpmodtime("/", "/bin/sh");
+  bb_file_cache_stats(&hits2, &misses2);
+  bb_assert(hits2 == hits + 2);
+  bb_assert(misses2 == misses);
+
+  bb_file_delete(".bb/tests");
+  bb_info("All tests passed");
+  return 0;
+}
@@ -0,0 +1,84 @@
+// Checks that a served jobserver, through a pipe or a fifo, limits the jobs
+// of the builds run under it, which join it, and that its tokens are all
+// given back. It runs itself as the server and as the builds. Run from the
+// repository root:
+//   cc -o tests/jobserver -pthread tests/jobserver.c && tests/jobserver
+#define BB_SOURCE "tests/jobserver.c"
+#define BB_REBUILD_ARGS "-o", "tests/jobserver", "-pthread", BB_SOURCE
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+#define SLEEP_NS 300000000
+
+// Run two jobs, which may run at once, but only one does, as the server
+// has no token left.
+static void check_client(void) {
+  bb_jobs_t jobs;
+  bb_cmd_t cmd;
+  uint64_t start;
+
+  bb_assert(_bb_jobserver.active);
+  bb_assert(!_bb_jobserver.serving);
+  start = _bb_time_ns();
+  jobs = bb_jobs_new(2);
+  for (int i = 0; i < 2; ++i) {
+    cmd = bb_cmd_new();
+    bb_cmd_append_args(cmd, "sleep", "0.3");
+    bb_jobs_submit(jobs, &cmd);
+  }
+  bb_assert(bb_jobs_wait_all(jobs) == 0);
+  bb_jobs_destroy(&jobs);
+  bb_assert(_bb_time_ns() - start >= 2 * SLEEP_NS);
+}
+
+// Run two clients at once, taking both tokens of -j 2.
+static void check_server(void) {
+  bb_jobs_t jobs;
+  bb_cmd_t cmd;
+  char tokens[4];
+
+  bb_assert(_bb_jobserver.active);
+  bb_assert(_bb_jobserver.serving);
+  jobs = bb_jobs_new(2);
+  for (int i = 0; i < 2; ++i) {
+    cmd = bb_cmd_new();
+    bb_cmd_append_args(cmd, "tests/jobserver", "--check=client");
+    bb_jobs_submit(jobs, &cmd);
+  }
+  bb_assert(bb_jobs_wait_all(jobs) == 0);
+  bb_jobs_destroy(&jobs);
+
+  // NOTE: Our own token is implicit, the other one is back in the pipe.
+  bb_assert(_bb_jobserver.nonblocking);
+  bb_assert(read(_bb_jobserver.read_fd, tokens, sizeof(tokens)) == 1);
+  bb_assert(write(_bb_jobserver.write_fd, tokens, 1) == 1);
+}
+
+static void run_server(const char* style) {
+  bb_cmd_t cmd;
+
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, "tests/jobserver", "--check=server", "-j", "2");
+  bb_cmd_append_argf(cmd, "--jobserver=%s", style);
+  bb_assert(bb_cmd_run(cmd) == 0);
+  bb_cmd_destroy(&cmd);
+}
+
+int bb_main(void) {
+  const char* check = bb_params_get_string("check", '\0', "", "");
+
+  if (!strcmp(check, "client")) {
+    check_client();
+    return 0;
+  } else if (!strcmp(check, "server")) {
+    check_server();
+    return 0;
+  }
+
+  // NOTE: Under make, its jobserver would be joined instead.
+  unsetenv("MAKEFLAGS");
+  run_server("pipe");
+  run_server("fifo");
+  bb_info("All tests passed");
+  return 0;
+}
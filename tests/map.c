@@ -0,0 +1,141 @@
+// Checks that entries of a bb_map_t are found after inserts, removals and
+// while it grows, also when their hashes collide. Run from the repository
+// root:
+//   cc -o tests/map -pthread tests/map.c && tests/map
+#define BB_SOURCE "tests/map.c"
+#define BB_REBUILD_ARGS "-o", "tests/map", "-pthread", BB_SOURCE
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+#define N 5000
+
+static void key_of(size_t i, char* key, size_t size) {
+  snprintf(key, size, "out/obj/module%zu/file%zu.o", i % 13, i);
+}
+
+// Check that exactly the keys i with present(i) are in the map, with i as
+// their value.
+static void check(bb_map_t map, int (*present)(size_t)) {
+  char key[64];
+  const char* found_key;
+  size_t* value;
+  size_t iter = 0, n = 0;
+
+  for (size_t i = 0; i < N; ++i) {
+    key_of(i, key, sizeof(key));
+    value = bb_map_find_cstr(map, key);
+    if (present(i)) {
+      bb_assert(value != NULL);
+      bb_assert(*value == i);
+      ++n;
+    } else
+      bb_assert(value == NULL);
+  }
+  bb_assert(bb_map_length(map) == n);
+
+  while (bb_map_next(map, &iter, &found_key, (void**)&value)) {
+    key_of(*value, key, sizeof(key));
+    bb_assert(!strcmp(found_key, key));
+    --n;
+  }
+  bb_assert(n == 0);
+}
+
+static int all(size_t i) {
+  BB_UNUSED(i);
+  return BB_TRUE;
+}
+
+static int odd(size_t i) {
+  return i & 1;
+}
+
+int bb_main(void) {
+  static const char binary[] = {'a', '\0', 'b'};
+  char key[64];
+  size_t *value, old_capacity, v;
+  bb_map_t map;
+  int removed;
+
+  map = bb_map_new(size_t);
+  old_capacity = map->capacity;
+  for (size_t i = 0; i < N; ++i) {
+    key_of(i, key, sizeof(key));
+    bb_map_insert_cstr(map, key, &i);
+  }
+  bb_assert(map->capacity > old_capacity);
+  check(map, all);
+
+  // Replacing a value does not add an entry.
+  key_of(7, key, sizeof(key));
+  v = 8;
+  bb_map_insert_cstr(map, key, &v);
+  bb_assert(bb_map_length(map) == N);
+  v = 7;
+  bb_map_insert_cstr(map, key, &v);
+
+  for (size_t i = 0; i < N; i += 2) {
+    key_of(i, key, sizeof(key));
+    bb_assert(bb_map_remove_cstr(map, key));
+    bb_assert(!bb_map_remove_cstr(map, key));
+  }
+  check(map, odd);
+  for (size_t i = 0; i < N; i += 2) {
+    key_of(i, key, sizeof(key));
+    bb_map_insert_cstr(map, key, &i);
+  }
+  check(map, all);
+  bb_map_destroy(&map);
+
+  // Keys with the same hash are probed past each other.
+  map = bb_map_new(size_t);
+  for (size_t i = 0; i < 10; ++i) {
+    key_of(i, key, sizeof(key));
+    bb_map_insert_hashed(map, key, strlen(key), 42, &i);
+  }
+  for (size_t i = 0; i < 10; ++i) {
+    key_of(i, key, sizeof(key));
+    value = bb_map_find_hashed(map, key, strlen(key), 42);
+    bb_assert(value != NULL && *value == i);
+  }
+  bb_map_destroy(&map);
+
+  // A map almost full, so that most keys are not in their ideal slot, and
+  // are moved back as the ones before them are removed.
+  map = bb_map_new(size_t);
+  for (size_t i = 0; i < 14; ++i) {
+    key_of(i, key, sizeof(key));
+    bb_map_insert_cstr(map, key, &i);
+  }
+  bb_assert(map->capacity == BB_MAP_MIN_CAPACITY);
+  for (size_t i = 0; i < 14; ++i) {
+    key_of(i, key, sizeof(key));
+    bb_assert(bb_map_remove_cstr(map, key));
+    for (size_t j = 0; j < 14; ++j) {
+      key_of(j, key, sizeof(key));
+      value = bb_map_find_cstr(map, key);
+      removed = j <= i;
+      bb_assert((value == NULL) == removed);
+      bb_assert(value == NULL || *value == j);
+    }
+  }
+  bb_assert(bb_map_length(map) == 0);
+  bb_map_destroy(&map);
+
+  // Keys are not strings.
+  map = bb_map_new(size_t);
+  v = 1;
+  bb_map_insert(map, binary, sizeof(binary), &v);
+  v = 2;
+  bb_map_insert(map, binary, 1, &v);
+  v = 3;
+  bb_map_insert(map, "", 0, &v);
+  bb_assert(*(size_t*)bb_map_find(map, binary, sizeof(binary)) == 1);
+  bb_assert(*(size_t*)bb_map_find_cstr(map, "a") == 2);
+  bb_assert(*(size_t*)bb_map_find_cstr(map, "") == 3);
+  bb_assert(bb_map_find(map, binary, 2) == NULL);
+  bb_map_destroy(&map);
+
+  bb_info("All tests passed");
+  return 0;
+}
@@ -0,0 +1,82 @@
+// Checks that parameters are only found by their whole name, e.g. that
+// --cache-size is not taken for --cache. It runs itself with the
+// parameters to check. Run from the repository root:
+//   cc -o tests/params -pthread tests/params.c && tests/params
+#define BB_SOURCE "tests/params.c"
+#define BB_REBUILD_ARGS "-o", "tests/params", "-pthread", BB_SOURCE
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+static void check_cache(void) {
+  const long no_size = 0;
+  struct stat info;
+
+  bb_assert(!strcmp(bb_params_get_string("cache", '\0', "", ""), ""));
+  bb_assert(bb_params_get_int("cache-size", '\0', "", &no_size) == 100);
+  bb_assert(bb_params_get_switch("cache-hardlink", '\0', "", BB_FALSE));
+  bb_assert(_bb_cache.dir == NULL);
+  bb_assert(stat("100", &info) < 0);
+}
+
+static void check_hardlink(void) {
+  bb_assert(!strcmp(bb_params_get_string("cache", '\0', "", ""), ""));
+  bb_assert(bb_params_get_switch("cache-hardlink", '\0', "", BB_FALSE));
+  bb_assert(_bb_cache.dir == NULL);
+}
+
+static void check_jobserver(void) {
+  const long no_jobs = 0;
+
+  bb_assert(!strcmp(bb_params_get_string("jobserver", '\0', "", ""),
+                    "fifo"));
+  bb_assert(bb_params_get_int("jobs", 'j', "", &no_jobs) == 3);
+  // NOTE: Under make, its jobserver is joined instead.
+  bb_assert(_bb_jobserver.active);
+  bb_assert(!_bb_jobserver.serving || _bb_jobserver.fifo_path != NULL);
+}
+
+static void check_no_jobserver(void) {
+  // NOTE: Only a jobserver of make may be joined, none is served.
+  bb_assert(!_bb_jobserver.serving);
+}
+
+static void run_check(const char* check, ...) {
+  bb_cmd_t cmd;
+  const char* arg;
+  va_list ap;
+
+  cmd = bb_cmd_new();
+  bb_cmd_append_args(cmd, "tests/params");
+  va_start(ap, check);
+  while ((arg = va_arg(ap, const char*)) != NULL)
+    bb_cmd_append_args(cmd, arg);
+  va_end(ap);
+  bb_cmd_append_args(cmd, check);
+  bb_assert(bb_cmd_run(cmd) == 0);
+  bb_cmd_destroy(&cmd);
+}
+
+int bb_main(void) {
+  const char* check = bb_params_get_string("check", '\0', "", "");
+
+  if (!strcmp(check, "cache")) {
+    check_cache();
+    return 0;
+  } else if (!strcmp(check, "hardlink")) {
+    check_hardlink();
+    return 0;
+  } else if (!strcmp(check, "jobserver")) {
+    check_jobserver();
+    return 0;
+  } else if (!strcmp(check, "no-jobserver")) {
+    check_no_jobserver();
+    return 0;
+  }
+
+  run_check("--check=cache", "--cache-size=100", "--cache-hardlink", NULL);
+  run_check("--check=hardlink", "--cache-hardlink", NULL);
+  run_check("--check=jobserver", "--jobserver=fifo", "-j", "3", NULL);
+  run_check("--check=no-jobserver", "-j", "3", NULL);
+  bb_info("All tests passed");
+  return 0;
+}
@@ -0,0 +1,85 @@
+// Checks the bulk and positional operations of vectors, on the heap and
+// in an arena, and that they keep the items in place while growing. Run
+// from the repository root:
+//   cc -o tests/vector -pthread tests/vector.c && tests/vector
+#define BB_SOURCE "tests/vector.c"
+#define BB_REBUILD_ARGS "-o", "tests/vector", "-pthread", BB_SOURCE
+#define BB_IMPLEMENTATION
+#include "../bb.h"
+
+// Check that vec holds the items given after length.
+static void check(long* vec, size_t length, ...) {
+  va_list ap;
+
+  bb_assert(bb_vector_length(vec) == length);
+  bb_assert(bb_vector_capacity(vec) >= length);
+  va_start(ap, length);
+  for (size_t i = 0; i < length; ++i)
+    bb_assert(vec[i] == va_arg(ap, long));
+  va_end(ap);
+}
+
+static void check_ops(bb_arena_t arena) {
+  static const long items[] = {1, 2, 3, 4};
+  long *vec, item;
+  size_t capacity;
+
+  vec = bb_vector_default_in(arena, long);
+  check(vec, 0);
+  bb_assert(bb_vector_pop(vec, &item) == -1);
+
+  bb_vector_extend(vec, items, 4);
+  bb_vector_extend(vec, items, 0);
+  check(vec, 4, 1L, 2L, 3L, 4L);
+  bb_vector_insert(vec, long, 0, 0);
+  bb_vector_insert(vec, long, 5, 5);
+  bb_vector_insert(vec, long, 3, 9);
+  check(vec, 7, 0L, 1L, 2L, 9L, 3L, 4L, 5L);
+
+  bb_vector_remove(vec, 3);
+  check(vec, 6, 0L, 1L, 2L, 3L, 4L, 5L);
+  bb_vector_swap_remove(vec, 1);
+  check(vec, 5, 0L, 5L, 2L, 3L, 4L);
+  bb_vector_swap_remove(vec, 4);
+  check(vec, 4, 0L, 5L, 2L, 3L);
+  bb_assert(bb_vector_pop(vec, &item) == 3);
+  bb_assert(item == 3);
+  check(vec, 3, 0L, 5L, 2L);
+
+  // Reserving grows the vector once, and never shrinks it.
+  bb_vector_reserve(vec, 1000);
+  capacity = bb_vector_capacity(vec);
+  bb_assert(capacity >= 1000);
+  check(vec, 3, 0L, 5L, 2L);
+  for (long i = 3; i < 1000; ++i)
+    bb_vector_push(vec, long, i);
+  bb_assert(bb_vector_capacity(vec) == capacity);
+  bb_vector_reserve(vec, 10);
+  bb_assert(bb_vector_capacity(vec) == capacity);
+
+  // Pushing past the capacity keeps the items.
+  for (long i = 1000; i < 5000; ++i)
+    bb_vector_push(vec, long, i);
+  bb_assert(bb_vector_length(vec) == 5000);
+  bb_assert(vec[1] == 5);
+  for (long i = 3; i < 5000; ++i)
+    bb_assert(vec[i] == i);
+
+  bb_vector_clear(vec);
+  check(vec, 0);
+  bb_assert(bb_vector_capacity(vec) >= 5000);
+  bb_vector_destroy(&vec);
+  bb_assert(vec == NULL);
+}
+
+int bb_main(void) {
+  bb_arena_t arena;
+
+  check_ops(NULL);
+  arena = bb_arena_new(0);
+  check_ops(arena);
+  bb_arena_destroy(&arena);
+
+  bb_info("All tests passed");
+  return 0;
+}